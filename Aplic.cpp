@@ -2,18 +2,65 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "Aplic.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
 #include <unordered_set>
 
 using namespace TT_APLIC;
 
-Aplic::Aplic(unsigned num_harts, unsigned num_sources, std::span<const DomainParams> domain_params_list)
-    : num_harts_(num_harts), num_sources_(num_sources)
+SourceStateQueue::SourceStateQueue(size_t capacity)
+    : cells_(new Cell[std::bit_ceil(capacity)]), mask_(std::bit_ceil(capacity) - 1)
+{
+    // A cell is free for the push at position pos when its sequence is pos,
+    // and holds that push's data when its sequence is pos + 1.
+    for (size_t pos = 0; pos <= mask_; pos++)
+        cells_[pos].sequence.store(pos, std::memory_order_relaxed);
+}
+
+bool SourceStateQueue::push(unsigned i, bool state)
+{
+    size_t pos = push_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &cells_[pos & mask_];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        auto diff = intptr_t(sequence) - intptr_t(pos);
+        if (diff == 0) {
+            if (push_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;   // the cell from one lap ago has not been popped
+        } else {
+            pos = push_pos_.load(std::memory_order_relaxed);
+        }
+    }
+    cell->source = i;
+    cell->state = state;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool SourceStateQueue::pop(unsigned& i, bool& state)
+{
+    Cell* cell = &cells_[pop_pos_ & mask_];
+    if (cell->sequence.load(std::memory_order_acquire) != pop_pos_ + 1)
+        return false;
+    i = cell->source;
+    state = cell->state;
+    cell->sequence.store(pop_pos_ + mask_ + 1, std::memory_order_release);
+    pop_pos_++;
+    return true;
+}
+
+Aplic::Aplic(unsigned num_harts, unsigned num_sources, std::span<const DomainParams> domain_params_list, bool thread_safe)
+    : num_harts_(num_harts), num_sources_(num_sources), thread_safe_(thread_safe)
 {
     if (num_harts > 16384)
         throw std::runtime_error("APLIC cannot have more than 16384 harts\n");
     if (num_sources > 1023)
         throw std::runtime_error("APLIC cannot have more than 1023 sources\n");
-    source_states_.resize(num_sources_ + 1);
+    drained_.reserve(source_state_queue_capacity);
 
     std::unordered_set<std::string> uniq_names;
     for (const auto& domain_params : domain_params_list) {
@@ -44,6 +91,84 @@ Aplic::Aplic(unsigned num_harts, unsigned num_sources, std::span<const DomainPar
         if (not made_progress)
             throw std::runtime_error("invalid domain hierarchy; possible cycle in graph\n");
     }
+
+    buildDecodeTable();
+    if (root_)
+        buildLockOrder(root_.get());
+    source_owners_ = std::vector<std::atomic<Domain*>>(num_sources_ + 1);
+    for (auto& owner : source_owners_)
+        owner = root_.get();
+    updateMsiGeometry();
+}
+
+void Aplic::updateMsiGeometry()
+{
+    if (not root_)
+        return;
+    msi_geometry_ = MsiAddrGeometry(root_->mmsiaddrcfg_, root_->mmsiaddrcfgh_, root_->smsiaddrcfg_, root_->smsiaddrcfgh_);
+    for (auto& domain : domains_)
+        for (unsigned i = 0; i < domain->target_.size(); i++)
+            domain->updateMsiAddr(i);
+}
+
+void Aplic::buildLockOrder(Domain* domain)
+{
+    domain->subtree_begin_ = lock_order_.size();
+    lock_order_.push_back(domain);
+    for (auto& child : domain->children_)
+        buildLockOrder(child.get());
+    domain->subtree_end_ = lock_order_.size();
+}
+
+Aplic::SubtreeLock::SubtreeLock(const Aplic& aplic, Domain* domain)
+{
+    if (not aplic.thread_safe_)
+        return;
+    domains_ = std::span(aplic.lock_order_).subspan(domain->subtree_begin_, domain->subtree_end_ - domain->subtree_begin_);
+    for (Domain* d : domains_)
+        d->mutex_.lock();
+}
+
+Aplic::SubtreeLock::~SubtreeLock()
+{
+    for (auto it = domains_.rbegin(); it != domains_.rend(); ++it)
+        (*it)->mutex_.unlock();
+}
+
+Domain* Aplic::lockOwner(unsigned i, std::optional<SubtreeLock>& lock)
+{
+    while (true) {
+        Domain* owner = source_owners_[i];
+        lock.emplace(*this, owner);
+        // the owner can only change with its lock held
+        if (not thread_safe_ or source_owners_[i] == owner)
+            return owner;
+        lock.reset();
+    }
+}
+
+void Aplic::buildDecodeTable()
+{
+    decode_table_.clear();
+    for (size_t i = 0; i < domains_.size(); i++) {
+        auto& domain = domains_[i];
+        decode_table_.push_back({domain->base(), domain->base() + domain->size(), domain.get(), i});
+    }
+    std::sort(decode_table_.begin(), decode_table_.end(),
+              [](const DecodeEntry& a, const DecodeEntry& b) { return a.base < b.base; });
+}
+
+const Aplic::DecodeEntry* Aplic::decode(uint64_t addr) const
+{
+    // first region starting above addr; the candidate is the one before it
+    auto it = std::upper_bound(decode_table_.begin(), decode_table_.end(), addr,
+                               [](uint64_t addr, const DecodeEntry& entry) { return addr < entry.base; });
+    if (it == decode_table_.begin())
+        return nullptr;
+    --it;
+    if (addr >= it->end)
+        return nullptr;
+    return &*it;
 }
 
 std::shared_ptr<Domain> Aplic::createDomain(const DomainParams& params)
@@ -57,7 +182,7 @@ std::shared_ptr<Domain> Aplic::createDomain(const DomainParams& params)
     if (params.size % 4096 != 0)
         throw std::runtime_error("size of domain '" + params.name + "' (" + std::to_string(params.size) + ") is not aligned to 4KiB\n");
 
-    for (auto domain : domains_) {
+    for (auto& domain : domains_) {
         if (domain->overlaps(params.base, params.size))
             throw std::runtime_error("control regions for domains '" + params.name + "' and '" + domain->name_ + "' overlap\n");
     }
@@ -87,7 +212,7 @@ std::shared_ptr<Domain> Aplic::createDomain(const DomainParams& params)
     if (findDomainByName(params.name) != nullptr)
         throw std::runtime_error("domain with name '" + params.name + "' already exists\n");
 
-    for (auto domain : domains_) {
+    for (auto& domain : domains_) {
         if (domain->privilege_ != params.privilege)
             continue;
         for (unsigned i : params.hart_indices) {
@@ -103,6 +228,10 @@ std::shared_ptr<Domain> Aplic::createDomain(const DomainParams& params)
             std::string msg = "for domain '" + params.name + "', hart index " + std::to_string(i) + " must be less than number of harts, " + std::to_string(num_harts_) + "\n";
             throw std::runtime_error(msg);
         }
+        if (std::count(params.hart_indices.begin(), params.hart_indices.end(), i) > 1) {
+            std::string msg = "for domain '" + params.name + "', hart index " + std::to_string(i) + " is listed more than once\n";
+            throw std::runtime_error(msg);
+        }
     }
     if (params.privilege == Supervisor) {
         for (unsigned i : params.hart_indices) {
@@ -113,20 +242,18 @@ std::shared_ptr<Domain> Aplic::createDomain(const DomainParams& params)
         }
     }
 
-    auto domain = std::shared_ptr<Domain>(new Domain(this, parent, params));
+    auto domain = std::shared_ptr<Domain>(new Domain(this, parent.get(), params));
     if (parent)
         parent->children_.push_back(domain);
     if (!root_)
         root_ = domain;
-    domain->setDirectCallback(direct_callback_);
-    domain->setMsiCallback(msi_callback_);
     domains_.push_back(domain);
     return domain;
 }
 
 std::shared_ptr<Domain> Aplic::findDomainByName(std::string_view name) const
 {
-    for (auto domain : domains_)
+    for (auto& domain : domains_)
         if (domain->name_ == name)
             return domain;
     return nullptr;
@@ -134,24 +261,217 @@ std::shared_ptr<Domain> Aplic::findDomainByName(std::string_view name) const
 
 std::shared_ptr<Domain> Aplic::findDomainByAddr(uint64_t addr) const
 {
-    for (auto domain : domains_)
-        if (domain->containsAddr(addr))
-            return domain;
-    return nullptr;
+    auto entry = decode(addr);
+    if (entry == nullptr)
+        return nullptr;
+    return domains_[entry->index];
+}
+
+std::shared_ptr<Domain> Aplic::findDomainBySource(unsigned i) const
+{
+    if (i == 0 or i > num_sources_)
+        return nullptr;
+    Domain* owner = source_owners_[i];
+    return owner ? owner->shared_from_this() : nullptr;
 }
 
 void Aplic::reset()
 {
-    for (unsigned i = 0; i <= num_sources_; i++)
-        source_states_[i] = 0;
-    if (root_)
-        root_->reset();
+    // changes posted before the reset are dropped, not applied after it
+    std::lock_guard drain_lock(drain_mutex_);
+    unsigned i;
+    bool state;
+    for (size_t n = 0; n < source_state_queue_capacity and source_state_queue_.pop(i, state); n++)
+        ;
+    if (not root_)
+        return;
+    SubtreeLock lock(*this, root_.get());
+    for (auto& word : source_states_)
+        word.store(0, std::memory_order_relaxed);
+    root_->reset();
+    for (auto& owner : source_owners_)
+        owner = root_.get();
+    updateMsiGeometry();
+    if (trace_) [[unlikely]]
+        trace(TraceOp::Reset);
+}
+
+void Aplic::startTrace(const std::string& path)
+{
+    stopTrace();
+    TraceHeader header;
+    header.num_harts = num_harts_;
+    header.num_sources = num_sources_;
+    header.thread_safe = thread_safe_;
+    header.auto_forward_via_msi = autoForwardViaMsi;
+    for (auto& domain : domains_) {
+        DomainParams params;
+        params.name = domain->name_;
+        if (domain->parent_)
+            params.parent = domain->parent_->name_;
+        params.child_index = domain->child_index_;
+        params.base = domain->base_;
+        params.size = domain->size_;
+        params.privilege = domain->privilege_;
+        params.hart_indices = domain->hart_indices_;
+        params.ipriolen = domain->ipriolen_;
+        params.eiidlen = domain->eiidlen_;
+        params.direct_mode_supported = domain->dm0_ok_;
+        params.msi_mode_supported = domain->dm1_ok_;
+        params.le_supported = domain->be0_ok_;
+        params.be_supported = domain->be1_ok_;
+        header.domains.push_back(std::move(params));
+    }
+    header.state = saveState();
+    trace_ = std::make_unique<TraceRecorder>(path, header);
+    for (auto& domain : domains_)
+        domain->trace_ = trace_.get();
+}
+
+void Aplic::trace(TraceOp op, uint64_t addr, uint32_t data, bool result)
+{
+    uint8_t flags = (result ? trace_result : 0) | (autoForwardViaMsi ? trace_auto_forward : 0);
+    trace_->record(op, addr, data, flags);
+}
+
+void Aplic::throwIfTracing() const
+{
+    if (trace_)
+        throw std::runtime_error("cannot change APLIC delivery while tracing\n");
+}
+
+void Aplic::stopTrace()
+{
+    for (auto& domain : domains_)
+        domain->trace_ = nullptr;
+    trace_.reset();
+}
+
+std::vector<std::pair<std::string, DomainStats>> Aplic::stats() const
+{
+    std::vector<std::pair<std::string, DomainStats>> stats;
+    for (auto& domain : domains_)
+        stats.push_back({domain->name(), domain->stats()});
+    return stats;
+}
+
+void Aplic::resetStats()
+{
+    for (auto& domain : domains_)
+        domain->resetStats();
+}
+
+std::unique_ptr<Aplic> Aplic::fork() const
+{
+    if (inBatch())
+        throw std::runtime_error("cannot fork APLIC within a batch\n");
+    auto copy = std::make_unique<Aplic>(num_harts_, num_sources_, std::span<const DomainParams>(), thread_safe_);
+    copy->autoForwardViaMsi = autoForwardViaMsi;
+    copy->callback_sink_ = callback_sink_;
+    if (not root_)
+        return copy;
+
+    SubtreeLock lock(*this, root_.get());
+    for (unsigned w = 0; w < source_states_.size(); w++)
+        copy->source_states_[w].store(source_states_[w].load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+    // Parents precede their children in domains_, and siblings are in child
+    // index order, so the copies can be linked up as they are made. clones
+    // is indexed like lock_order_.
+    std::vector<Domain*> clones(lock_order_.size());
+    for (auto& domain : domains_) {
+        Domain* parent = domain->parent_ ? clones[domain->parent_->subtree_begin_] : nullptr;
+        auto clone = std::shared_ptr<Domain>(new Domain(copy.get(), parent, *domain));
+        clones[domain->subtree_begin_] = clone.get();
+        if (parent)
+            parent->children_.push_back(clone);
+        else
+            copy->root_ = clone;
+        copy->domains_.push_back(clone);
+    }
+
+    copy->buildDecodeTable();
+    copy->buildLockOrder(copy->root_.get());
+    for (unsigned i = 0; i < source_owners_.size(); i++)
+        copy->source_owners_[i] = clones[source_owners_[i].load()->subtree_begin_];
+    copy->msi_geometry_ = msi_geometry_;
+    return copy;
+}
+
+// Words at the start of a saved state: magic, version, num_harts,
+// num_sources and the number of domains.
+static constexpr uint32_t state_magic = 0x41504c53;   // "APLS"
+static constexpr uint32_t state_version = 1;
+static constexpr size_t state_header_size = 5;
+
+std::vector<uint8_t> Aplic::saveState() const
+{
+    if (inBatch())
+        throw std::runtime_error("cannot save APLIC state within a batch\n");
+    std::vector<uint32_t> state = {state_magic, state_version, num_harts_, num_sources_, uint32_t(domains_.size())};
+    if (root_) {
+        SubtreeLock lock(*this, root_.get());
+        for (unsigned w = 0; w <= num_sources_/32; w++)
+            state.push_back(source_states_[w].load(std::memory_order_relaxed));
+        for (auto& domain : domains_)
+            domain->saveState(state);
+    }
+    std::vector<uint8_t> bytes(state.size()*sizeof(uint32_t));
+    std::memcpy(bytes.data(), state.data(), bytes.size());
+    return bytes;
+}
+
+void Aplic::restoreState(std::span<const uint8_t> bytes)
+{
+    if (inBatch())
+        throw std::runtime_error("cannot restore APLIC state within a batch\n");
+    std::vector<uint32_t> state(bytes.size()/sizeof(uint32_t));
+    std::memcpy(state.data(), bytes.data(), state.size()*sizeof(uint32_t));
+
+    // Check the whole layout before changing anything.
+    size_t size = state_header_size + (root_ ? num_sources_/32 + 1 : 0);
+    bool matches = bytes.size() % sizeof(uint32_t) == 0 and state.size() >= state_header_size
+        and state[0] == state_magic and state[1] == state_version and state[2] == num_harts_
+        and state[3] == num_sources_ and state[4] == domains_.size();
+    for (auto& domain : domains_) {
+        if (not matches or state.size() < size + domain->stateSize())
+            matches = false;
+        else
+            matches = domain->stateMatches(&state[size]);
+        size += domain->stateSize();
+    }
+    if (not matches or state.size() != size)
+        throw std::runtime_error("saved state does not match this APLIC\n");
+    if (not root_)
+        return;
+
+    SubtreeLock lock(*this, root_.get());
+    const uint32_t* pos = &state[state_header_size];
+    for (unsigned w = 0; w < source_states_.size(); w++)
+        source_states_[w].store(w <= num_sources_/32 ? *pos++ : 0, std::memory_order_relaxed);
+    for (auto& domain : domains_) {
+        domain->restoreState(pos);
+        pos += domain->stateSize();
+    }
+
+    // Parents precede their children in domains_, so each source ends up
+    // owned by the deepest domain it is delegated to.
+    for (auto& owner : source_owners_)
+        owner = root_.get();
+    for (auto& domain : domains_)
+        for (unsigned i = 1; i <= num_sources_; i++)
+            if (domain->sourcecfg_[i].dx.d and source_owners_[i] == domain.get())
+                source_owners_[i] = domain->children_[domain->sourcecfg_[i].d1.child_index].get();
+    updateMsiGeometry();
+    if (trace_) [[unlikely]] {
+        for (uint32_t word : state)
+            trace(TraceOp::StateWord, 0, word);
+        trace(TraceOp::RestoreState);
+    }
 }
 
 bool Aplic::containsAddr(uint64_t addr) const {
-    if (findDomainByAddr(addr) == nullptr)
-        return false;
-    return true;
+    return decode(addr) != nullptr;
 }
 
 bool Aplic::read(uint64_t addr, size_t size, uint32_t& data)
@@ -160,10 +480,22 @@ bool Aplic::read(uint64_t addr, size_t size, uint32_t& data)
         return false;
     if (addr % 4 != 0)
         return false;
-    auto domain = findDomainByAddr(addr);
-    if (domain == nullptr)
+    auto entry = decode(addr);
+    if (entry == nullptr)
         return false;
-    data = domain->read(addr);
+    Domain* domain = entry->domain;
+    uint64_t offset = addr - domain->base();
+    if (thread_safe_ and Domain::isClaimRead(offset)) {
+        SubtreeLock lock(*this, domain);
+        data = domain->read(addr);
+    } else if (thread_safe_ and not Domain::isLockFreeRead(offset)) {
+        std::lock_guard lock(domain->mutex_);
+        data = domain->read(addr);
+    } else {
+        data = domain->read(addr);
+    }
+    if (trace_) [[unlikely]]
+        trace(TraceOp::Read, addr, data);
     return true;
 }
 
@@ -173,39 +505,189 @@ bool Aplic::write(uint64_t addr, size_t size, uint32_t data)
         return false;
     if (addr % 4 != 0)
         return false;
-    auto domain = findDomainByAddr(addr);
-    if (domain == nullptr)
+    auto entry = decode(addr);
+    if (entry == nullptr)
         return false;
-    domain->write(addr, data);
+    SubtreeLock lock(*this, entry->domain);
+    entry->domain->write(addr, data);
+    if (trace_) [[unlikely]]
+        trace(TraceOp::Write, addr, data);
     return true;
 }
 
 void Aplic::setDirectCallback(DirectDeliveryCallback callback)
 {
-    direct_callback_ = callback;
-    if (root_)
-        root_->setDirectCallback(callback);
+    throwIfTracing();
+    callback_sink_.direct_callback = callback;
+    setDeliverySink(&callback_sink_);
 }
 
 void Aplic::setMsiCallback(MsiDeliveryCallback callback)
 {
-    msi_callback_ = callback;
+    throwIfTracing();
+    callback_sink_.msi_callback = callback;
+    setDeliverySink(&callback_sink_);
+}
+
+void Aplic::setMsiBatchCallback(MsiBatchDeliveryCallback callback)
+{
+    throwIfTracing();
+    callback_sink_.msi_batch_callback = callback;
+    setDeliverySink(&callback_sink_);
+}
+
+void Aplic::setDeliverySink(DeliverySink* sink)
+{
+    throwIfTracing();
     if (root_)
-        root_->setMsiCallback(callback);
+        root_->setDeliverySink(sink);
+}
+
+uint32_t Aplic::sourceMask(unsigned w) const
+{
+    unsigned first = w*32;
+    if (first > num_sources_)
+        return 0;
+    unsigned count = num_sources_ - first + 1;
+    uint32_t mask = count >= 32 ? ~0u : (1u << count) - 1;
+    if (w == 0)
+        mask &= ~1u;    // there is no source 0
+    return mask;
+}
+
+bool Aplic::exchangeSourceState(unsigned i, bool state)
+{
+    assert(i > 0 and i <= num_sources_);
+    uint32_t bit = 1u << (i % 32);
+    auto& word = source_states_[i/32];
+    uint32_t prev = state ? word.fetch_or(bit, std::memory_order_relaxed) : word.fetch_and(~bit, std::memory_order_relaxed);
+    return prev & bit;
 }
 
 void Aplic::setSourceState(unsigned i, bool state)
 {
-    assert(i > 0 && i < 1024);
-    bool prev_state = source_states_.at(i);
-    source_states_[i] = state;
-    if (prev_state != state)
-        root_->edge(i);
+    if (i == 0 or i > num_sources_)
+        throw std::out_of_range("source index out of range\n");
+    std::optional<SubtreeLock> lock;
+    Domain* owner = lockOwner(i, lock);
+    if (exchangeSourceState(i, state) != state)
+        owner->edge(i);
+    if (trace_) [[unlikely]]
+        trace(TraceOp::SourceState, i, state);
+}
+
+void Aplic::setSourceStates(std::span<const std::pair<unsigned, bool>> states, bool strict)
+{
+    for (auto [i, state] : states) {
+        if (i == 0 or i > num_sources_)
+            throw std::out_of_range("source index out of range\n");
+    }
+    if (strict) {
+        for (auto [i, state] : states)
+            setSourceState(i, state);
+        return;
+    }
+    SubtreeLock lock(*this, root_.get());
+    bool changed = false;
+    for (auto [i, state] : states) {
+        if (exchangeSourceState(i, state) != state) {
+            source_owners_[i].load()->applyEdge(i);
+            changed = true;
+        }
+    }
+    if (changed)
+        root_->runCallbacksAsRequired();
+    if (trace_) [[unlikely]] {
+        for (auto [i, state] : states)
+            trace(TraceOp::SourceStateEntry, i, state);
+        trace(TraceOp::SourceStates);
+    }
+}
+
+void Aplic::setSourceStates(unsigned w, uint32_t mask, uint32_t states, bool strict)
+{
+    assert(w < 32);
+    mask &= sourceMask(w);
+    if (strict) {
+        for (; mask; mask &= mask - 1) {
+            unsigned j = std::countr_zero(mask);
+            setSourceState(w*32 + j, (states >> j) & 1);
+        }
+        return;
+    }
+    SubtreeLock lock(*this, root_.get());
+    auto& word = source_states_[w];
+    uint32_t prev = word.load(std::memory_order_relaxed);
+    while (not word.compare_exchange_weak(prev, (prev & ~mask) | (states & mask), std::memory_order_relaxed))
+        ;
+    uint32_t changed = (prev ^ states) & mask;
+    for (uint32_t bits = changed; bits; bits &= bits - 1) {
+        unsigned i = w*32 + std::countr_zero(bits);
+        source_owners_[i].load()->applyEdge(i);
+    }
+    if (changed)
+        root_->runCallbacksAsRequired();
+    if (trace_) [[unlikely]]
+        trace(TraceOp::SourceStateWord, w | uint64_t(mask) << 32, states);
+}
+
+bool Aplic::postSourceState(unsigned i, bool state)
+{
+    if (i == 0 or i > num_sources_)
+        return false;
+    return source_state_queue_.push(i, state);
+}
+
+size_t Aplic::drainSourceStates(bool strict)
+{
+    std::lock_guard drain_lock(drain_mutex_);
+    drained_.clear();
+    unsigned i;
+    bool state;
+    // stop after one queue's worth so that busy producers cannot starve us
+    while (drained_.size() < source_state_queue_capacity and source_state_queue_.pop(i, state))
+        drained_.push_back({i, state});
+    if (not drained_.empty())
+        setSourceStates(drained_, strict);
+    return drained_.size();
+}
+
+void Aplic::commit()
+{
+    assert(batch_depth_ > 0);
+    if (--batch_depth_ == 0) {
+        SubtreeLock lock(*this, root_.get());
+        root_->runCallbacksAsRequired();
+    }
+    if (trace_) [[unlikely]]
+        trace(TraceOp::Commit);
 }
 
 bool Aplic::forwardViaMsi(unsigned i)
 {
-    for (auto domain : domains_) {
+    bool forwarded = forwardReadyViaMsi(i);
+    if (trace_) [[unlikely]]
+        trace(TraceOp::ForwardViaMsi, i, 0, forwarded);
+    return forwarded;
+}
+
+bool Aplic::forwardReadyViaMsi(unsigned i)
+{
+    if (i > num_sources_)
+        return false;
+    if (i != 0) {
+        // only the domain at the end of the delegation chain can have i pending
+        std::optional<SubtreeLock> lock;
+        Domain* domain = lockOwner(i, lock);
+        if (not domain->readyToForwardViaMsi(i))
+            return false;
+        domain->forwardViaMsi(i);
+        return true;
+    }
+    for (auto& domain : domains_) {
+        std::optional<std::lock_guard<std::mutex>> lock;
+        if (thread_safe_)
+            lock.emplace(domain->mutex_);
         if (domain->readyToForwardViaMsi(i)) {
             domain->forwardViaMsi(i);
             return true;
@@ -3,6 +3,10 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
 #include <string>
 #include <span>
 #include <vector>
@@ -11,52 +15,258 @@
 #include <cassert>
 
 #include "Domain.hpp"
+#include "Trace.hpp"
 
 namespace TT_APLIC {
 
+// Bounded lock-free queue of source state changes. Any number of threads may
+// push; one thread at a time may pop. Changes are popped in the order their
+// pushes claimed a position in the queue.
+class SourceStateQueue
+{
+public:
+    explicit SourceStateQueue(size_t capacity);
+
+    // Returns false, without waiting, if the queue is full.
+    bool push(unsigned i, bool state);
+
+    bool pop(unsigned& i, bool& state);
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        uint16_t source;
+        bool state;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> push_pos_ = 0;
+    alignas(64) size_t pop_pos_ = 0;
+};
+
 class Aplic
 {
+    friend Domain;
+
 public:
-    Aplic(unsigned num_harts, unsigned num_sources, std::span<const DomainParams> domain_params_list);
+    // With thread_safe set, read, write, setSourceState(s), forwardViaMsi,
+    // commit and reset may be called concurrently from several threads.
+    Aplic(unsigned num_harts, unsigned num_sources, std::span<const DomainParams> domain_params_list, bool thread_safe = false);
 
     std::shared_ptr<Domain> root() const { return root_; }
     unsigned numHarts() const { return num_harts_; }
     unsigned numSources() const { return num_sources_; }
+    bool threadSafe() const { return thread_safe_; }
 
     std::shared_ptr<Domain> findDomainByName(std::string_view name) const;
 
     std::shared_ptr<Domain> findDomainByAddr(uint64_t addr) const;
 
+    // Returns the domain that source i is currently delegated to, i.e. the
+    // only domain in which it can be active, or nullptr if i is not a valid
+    // source.
+    std::shared_ptr<Domain> findDomainBySource(unsigned i) const;
+
+    // Resets every domain and source state, and discards the source state
+    // changes queued by postSourceState.
     void reset();
 
+    // Returns a copy of this Aplic, with the same domains, state, callbacks
+    // or delivery sink and autoForwardViaMsi. The copies share each domain's
+    // per-source arrays (sourcecfg, target, ...) until one of them writes
+    // to one; in thread-safe mode nothing is shared. Source state changes
+    // queued by postSourceState are not copied. Cannot be called between
+    // beginBatch and commit.
+    std::unique_ptr<Aplic> fork() const;
+
+    // Returns the register state of every domain, the raw source input
+    // states and the xeip value last given to each hart, as a blob in host
+    // byte order. Source state changes queued by postSourceState are not
+    // included. Cannot be called between beginBatch and commit.
+    std::vector<uint8_t> saveState() const;
+
+    // Restores a blob returned by saveState on an Aplic with the same
+    // harts, sources and domain hierarchy. No callbacks are made.
+    void restoreState(std::span<const uint8_t> state);
+
     bool containsAddr(uint64_t addr) const;
 
     bool read(uint64_t addr, size_t size, uint32_t& data);
 
     bool write(uint64_t addr, size_t size, uint32_t data);
 
+    // The callback and sink setters throw std::runtime_error while a trace
+    // is being recorded.
     void setDirectCallback(DirectDeliveryCallback callback);
 
     void setMsiCallback(MsiDeliveryCallback callback);
 
-    bool getSourceState(unsigned i) const { return source_states_.at(i); }
+    // Optional. When set, the MSIs produced by one operation are passed to
+    // this callback together if there is more than one; a single MSI still
+    // goes to the MSI callback. They are in delivery order: domain by domain
+    // in pre-order of the hierarchy, and within a domain genmsi first, then
+    // by source ID.
+    void setMsiBatchCallback(MsiBatchDeliveryCallback callback);
+
+    // Delivers to sink instead of the callbacks; see DeliverySink. The sink
+    // is not owned. Setting a callback afterwards switches back to callbacks.
+    void setDeliverySink(DeliverySink* sink);
+
+    bool getSourceState(unsigned i) const
+    {
+        if (i > num_sources_)
+            throw std::out_of_range("source index out of range\n");
+        return (source_states_[i/32].load(std::memory_order_relaxed) >> (i % 32)) & 1;
+    }
+
+    // Raw input states of sources 32*w to 32*w+31, one bit per source.
+    uint32_t getSourceStateWord(unsigned w) const { return source_states_.at(w).load(std::memory_order_relaxed); }
 
     void setSourceState(unsigned i, bool state);
 
+    // Sets the input states of all the sources of word w at once, as
+    // setSourceStates(w, ~0u, states, strict) would.
+    void setSourceStateWord(unsigned w, uint32_t states, bool strict = false) { setSourceStates(w, ~0u, states, strict); }
+
+    // Applies a group of source state changes, in order, and then evaluates
+    // delivery once for the domains affected. The callbacks reflect the
+    // final state; transient deliveries that sequential setSourceState
+    // calls would have made within the group are not made. With strict set,
+    // this is exactly equivalent to calling setSourceState for each change.
+    // Throws std::out_of_range, without applying any change, if a source is
+    // 0 or above numSources.
+    void setSourceStates(std::span<const std::pair<unsigned, bool>> states, bool strict = false);
+
+    // As above, for the sources of word w (sources 32*w to 32*w+31) whose
+    // bits are set in mask, taking their new states from the bits of states.
+    // Bits for source 0 and sources beyond numSources are ignored.
+    void setSourceStates(unsigned w, uint32_t mask, uint32_t states, bool strict = false);
+
+    // Queues a change of source i's state without evaluating delivery, for
+    // device models on other threads. Never blocks; returns false if i is
+    // not a valid source or the queue is full. Safe to call concurrently
+    // with every other Aplic method. reset discards what is still queued.
+    bool postSourceState(unsigned i, bool state);
+
+    // Applies all queued source state changes in the order they were
+    // posted, as setSourceStates would, and returns how many were applied.
+    size_t drainSourceStates(bool strict = false);
+
+    static constexpr size_t source_state_queue_capacity = 4096;
+
     bool forwardViaMsi(unsigned i);
 
+    // Between beginBatch and commit, register writes and source state
+    // changes only update state; no callbacks are made. commit evaluates
+    // delivery once for every domain whose state changed, so a hart's xeip
+    // that was toggled on and off within the batch causes no callback.
+    // Batches nest; only the outermost commit evaluates delivery.
+    void beginBatch()
+    {
+        batch_depth_++;
+        if (trace_) [[unlikely]]
+            trace(TraceOp::BeginBatch);
+    }
+
+    void commit();
+
+    bool inBatch() const { return batch_depth_ > 0; }
+
     bool autoForwardViaMsi = true;
 
+    // Records the calls of read, write, setSourceState(s), forwardViaMsi,
+    // beginBatch, commit, reset and restoreState, and the deliveries they
+    // make, whether or not a callback or sink receives them, to a binary
+    // trace at path that aplic-replay can replay. The trace starts with this
+    // Aplic's domains and state. Not recorded: calls made directly on a
+    // Domain, and changes of autoForwardViaMsi, whose value is recorded only
+    // with each operation. Changing the callbacks or sink while tracing
+    // throws. Throws std::runtime_error if the file cannot be created. Like
+    // the callbacks, not protected in thread-safe mode.
+    void startTrace(const std::string& path);
+
+    // Flushes and closes the trace.
+    void stopTrace();
+
+    // Returns the name and counters of every domain, parents before their
+    // children. The counters are zero unless APLIC_ENABLE_STATS is
+    // defined; see DomainStats. A fork's counters start at zero.
+    std::vector<std::pair<std::string, DomainStats>> stats() const;
+
+    void resetStats();
+
 private:
     std::shared_ptr<Domain> createDomain(const DomainParams& params);
 
+    // Control regions sorted by base address, for binary-search decode of
+    // MMIO addresses. Regions never overlap, so at most one can match.
+    struct DecodeEntry {
+        uint64_t base;
+        uint64_t end;
+        Domain* domain;
+        size_t index;   // into domains_
+    };
+
+    void buildDecodeTable();
+
+    const DecodeEntry* decode(uint64_t addr) const;
+
+    // In thread-safe mode, an operation on a domain locks that domain and
+    // all of its descendants. These are contiguous in lock_order_, a
+    // pre-order of the domain tree, so locks are always taken in the same
+    // order. Outside of thread-safe mode this does nothing.
+    class SubtreeLock
+    {
+    public:
+        SubtreeLock(const Aplic& aplic, Domain* domain);
+        ~SubtreeLock();
+        SubtreeLock(const SubtreeLock&) = delete;
+        SubtreeLock& operator=(const SubtreeLock&) = delete;
+
+    private:
+        std::span<Domain* const> domains_;
+    };
+
+    void buildLockOrder(Domain* domain);
+
+    // Locks the subtree of the domain that owns source i and returns that
+    // domain, retrying if the source is re-delegated before the lock is held.
+    Domain* lockOwner(unsigned i, std::optional<SubtreeLock>& lock);
+
+    // Decodes the root domain's MSI address registers into msi_geometry_ and
+    // recomputes every domain's per-source MSI addresses.
+    void updateMsiGeometry();
+
+    bool forwardReadyViaMsi(unsigned i);
+
+    // Records an operation in the trace.
+    void trace(TraceOp op, uint64_t addr = 0, uint32_t data = 0, bool result = false);
+
+    void throwIfTracing() const;
+
+    // Bits of word w that correspond to implemented sources.
+    uint32_t sourceMask(unsigned w) const;
+
+    // Sets the raw input state of source i and returns its previous state.
+    bool exchangeSourceState(unsigned i, bool state);
+
     unsigned num_harts_;
     unsigned num_sources_;
     std::shared_ptr<Domain> root_;
     std::vector<std::shared_ptr<Domain>> domains_;
-    std::vector<bool> source_states_;
-    DirectDeliveryCallback direct_callback_ = nullptr;
-    MsiDeliveryCallback msi_callback_ = nullptr;
+    std::vector<DecodeEntry> decode_table_;
+    std::vector<std::atomic<Domain*>> source_owners_;  // per source, maintained by Domain
+    std::vector<Domain*> lock_order_;
+    MsiAddrGeometry msi_geometry_;
+    std::array<std::atomic<uint32_t>, 32> source_states_;   // raw input, one bit per source
+    std::atomic<unsigned> batch_depth_ = 0;
+    bool thread_safe_ = false;
+    CallbackSink callback_sink_;   // shared by all domains when callbacks are set here
+    std::unique_ptr<TraceRecorder> trace_;
+    SourceStateQueue source_state_queue_{source_state_queue_capacity};
+    std::mutex drain_mutex_;
+    std::vector<std::pair<unsigned, bool>> drained_;
 };
 
 }
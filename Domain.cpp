@@ -7,8 +7,8 @@
 using namespace TT_APLIC;
 
 Domain::Domain(
-    const Aplic *aplic,
-    std::shared_ptr<Domain> parent,
+    Aplic *aplic,
+    Domain* parent,
     const DomainParams& params
 ):
     ipriolen_(params.ipriolen),
@@ -18,8 +18,11 @@ Domain::Domain(
     be0_ok_(params.le_supported),
     be1_ok_(params.be_supported),
     aplic_(aplic),
+    source_states_(aplic->source_states_.data()),
     name_(params.name),
     parent_(parent),
+    root_(parent ? parent->root_ : this),
+    child_index_(params.child_index.value_or(0)),
     base_(params.base),
     size_(params.size),
     privilege_(params.privilege),
@@ -27,157 +30,554 @@ Domain::Domain(
 {
     assert(dm0_ok_ or dm1_ok_);
     assert(be0_ok_ or be1_ok_);
-    unsigned num_harts = aplic->numHarts();
-    xeip_bits_.resize(num_harts);
-    idcs_.resize(num_harts);
+    if (not hart_indices_.empty()) {
+        auto [lo, hi] = std::minmax_element(hart_indices_.begin(), hart_indices_.end());
+        hart_slot_base_ = *lo;
+        hart_slot_table_.assign(*hi - *lo + 1, no_hart_slot);
+        for (unsigned slot = 0; slot < hart_indices_.size(); slot++)
+            hart_slot_table_[hart_indices_[slot] - hart_slot_base_] = slot;
+    }
+
+    unsigned num_slots = hart_indices_.size();
+    xeip_bits_.resize(num_slots);
+    xeip_dirty_.resize(num_slots);
+    xeip_dirty_slots_.reserve(num_slots);
+    idcs_.resize(num_slots);
+    topi_heaps_.resize(num_slots);
+
+    unsigned num_sources = aplic->numSources();
+    sourcecfg_ = CowVector<Sourcecfg>(num_sources + 1);
+    target_ = CowVector<Target>(num_sources + 1);
+    msi_addrs_ = CowVector<uint64_t>(num_sources + 1);
+    heap_pos_.resize(num_sources + 1);
+    heap_slot_.resize(num_sources + 1);
     reset();
 }
 
+Domain::Domain(Aplic* aplic, Domain* parent, const Domain& other) :
+    ipriolen_(other.ipriolen_),
+    eiidlen_(other.eiidlen_),
+    dm0_ok_(other.dm0_ok_),
+    dm1_ok_(other.dm1_ok_),
+    be0_ok_(other.be0_ok_),
+    be1_ok_(other.be1_ok_),
+    aplic_(aplic),
+    source_states_(aplic->source_states_.data()),
+    name_(other.name_),
+    parent_(parent),
+    root_(parent ? parent->root_ : this),
+    child_index_(other.child_index_),
+    base_(other.base_),
+    size_(other.size_),
+    privilege_(other.privilege_),
+    hart_indices_(other.hart_indices_),
+    hart_slot_base_(other.hart_slot_base_),
+    hart_slot_table_(other.hart_slot_table_),
+    xeip_bits_(other.xeip_bits_),
+    xeip_dirty_(other.xeip_dirty_),
+    xeip_dirty_slots_(other.xeip_dirty_slots_),
+    xeip_all_dirty_(other.xeip_all_dirty_),
+    dirty_(other.dirty_),
+    subtree_dirty_(other.subtree_dirty_.load(std::memory_order_relaxed)),
+    domaincfg_(other.domaincfg_),
+    sourcecfg_(other.sourcecfg_),
+    mmsiaddrcfg_(other.mmsiaddrcfg_),
+    mmsiaddrcfgh_(other.mmsiaddrcfgh_),
+    smsiaddrcfg_(other.smsiaddrcfg_),
+    smsiaddrcfgh_(other.smsiaddrcfgh_),
+    setip_(other.setip_),
+    setie_(other.setie_),
+    ready_words_(other.ready_words_),
+    edge_mask_(other.edge_mask_),
+    level_mask_(other.level_mask_),
+    invert_mask_(other.invert_mask_),
+    detached_mask_(other.detached_mask_),
+    genmsi_(other.genmsi_),
+    target_(other.target_),
+    msi_addrs_(other.msi_addrs_),
+    idcs_(other.idcs_),
+    topi_heaps_(other.topi_heaps_),
+    heap_pos_(other.heap_pos_),
+    heap_slot_(other.heap_slot_)
+{
+    // Deliver to the copy's own callbacks, or to the same external sink.
+    if (other.sink_ == &other.aplic_->callback_sink_)
+        sink_ = &aplic->callback_sink_;
+    else
+        sink_ = other.sink_;
+
+    // sourcecfg is read without a lock in thread-safe mode, so its elements
+    // must not be replaced by a later write.
+    if (aplic->threadSafe()) {
+        sourcecfg_.detach();
+        target_.detach();
+        msi_addrs_.detach();
+    }
+}
+
 void Domain::reset()
 {
-    domaincfg_ = Domaincfg{};
-    domaincfg_.legalize(dm0_ok_, dm1_ok_, be0_ok_, be1_ok_);
+    Domaincfg domaincfg{};
+    domaincfg.legalize(dm0_ok_, dm1_ok_, be0_ok_, be1_ok_);
+    storeRelaxed(domaincfg_.value, domaincfg.value);
     mmsiaddrcfg_ = 0;
     mmsiaddrcfgh_ = Mmsiaddrcfgh{};
     smsiaddrcfg_ = 0;
     smsiaddrcfgh_ = Smsiaddrcfgh{};
-    for (unsigned i = 0; i < sourcecfg_.size(); i++) {
-        sourcecfg_[i] = Sourcecfg{};
-        target_[i] = Target{};
-    }
+    for (auto& cfg : sourcecfg_.mutAll())
+        storeRelaxed(cfg.value, 0);
+    target_.fill(Target{});
     for (unsigned i = 0; i < setip_.size(); i++) {
         setip_[i] = 0;
         setie_[i] = 0;
+        edge_mask_[i] = 0;
+        level_mask_[i] = 0;
+        invert_mask_[i] = 0;
+        detached_mask_[i] = 0;
     }
+    ready_words_ = 0;
 
-    unsigned num_harts = aplic_->numHarts();
-    for (unsigned i = 0; i < num_harts; i++)
-        xeip_bits_[i] = 0;
+    for (unsigned slot = 0; slot < idcs_.size(); slot++) {
+        xeip_bits_[slot] = 0;
+        xeip_dirty_[slot] = 0;
+        auto& idc = idcs_[slot];
+        idc.idelivery = 0;
+        idc.iforce = 0;
+        idc.ithreshold = 0;
+        storeRelaxed(idc.topi.value, 0);
+    }
+    xeip_dirty_slots_.clear();
+    xeip_all_dirty_ = false;
+    dirty_ = false;
+    subtree_dirty_.store(false, std::memory_order_relaxed);
 
-    for (unsigned i = 0; i < num_harts; i++)
-        idcs_[i] = Idc{};
+    for (auto& heap : topi_heaps_)
+        heap.clear();
+    std::fill(heap_pos_.begin(), heap_pos_.end(), not_in_heap);
 
-    for (auto child : children_)
+    for (auto& child : children_)
         child->reset();
 }
 
-void Domain::updateTopi()
+unsigned Domain::topiSlot(unsigned i) const
 {
-    if (domaincfg_.fields.dm == MSI)
-        return;
-    unsigned num_sources = aplic_->numSources();
-    for (auto hart_index : hart_indices_) {
-        idcs_[hart_index].topi = Topi{};
+    if (domaincfg_.fields.dm != Direct)
+        return no_slot;
+    if (not pending(i) or not enabled(i))
+        return no_slot;
+    return hartSlot(target_[i].dm0.hart_index);
+}
+
+void Domain::heapSiftUp(std::vector<uint32_t>& heap, size_t pos)
+{
+    uint32_t key = heap[pos];
+    while (pos > 0) {
+        size_t parent = (pos - 1)/2;
+        if (heap[parent] <= key)
+            break;
+        heap[pos] = heap[parent];
+        heap_pos_[heap[pos] & 0x3ff] = pos;
+        pos = parent;
     }
-    for (unsigned i = 1; i <= num_sources; i++) {
-        unsigned hart_index = target_[i].dm0.hart_index;
-        if (not includesHart(hart_index))
-            continue;
-        unsigned priority = target_[i].dm0.iprio;
-        unsigned ithreshold = idcs_[hart_index].ithreshold;
-        auto& topi = idcs_[hart_index].topi;
-        unsigned topi_prio = topi.fields.priority;
-        bool under_threshold = ithreshold == 0 or priority < ithreshold;
-        if (under_threshold and pending(i) and enabled(i) and (priority < topi_prio or topi_prio == 0)) {
+    heap[pos] = key;
+    heap_pos_[key & 0x3ff] = pos;
+}
+
+void Domain::heapSiftDown(std::vector<uint32_t>& heap, size_t pos)
+{
+    uint32_t key = heap[pos];
+    size_t size = heap.size();
+    while (true) {
+        size_t child = 2*pos + 1;
+        if (child >= size)
+            break;
+        if (child + 1 < size and heap[child + 1] < heap[child])
+            child++;
+        if (key <= heap[child])
+            break;
+        heap[pos] = heap[child];
+        heap_pos_[heap[pos] & 0x3ff] = pos;
+        pos = child;
+    }
+    heap[pos] = key;
+    heap_pos_[key & 0x3ff] = pos;
+}
+
+void Domain::heapInsert(unsigned slot, unsigned i)
+{
+    assert(heap_pos_[i] == not_in_heap);
+    auto& heap = topi_heaps_[slot];
+    heap.push_back(topiKey(i));
+    heap_slot_[i] = slot;
+    heapSiftUp(heap, heap.size() - 1);
+}
+
+void Domain::heapRemove(unsigned i)
+{
+    size_t pos = heap_pos_[i];
+    assert(pos != not_in_heap);
+    auto& heap = topi_heaps_[heap_slot_[i]];
+    heap_pos_[i] = not_in_heap;
+    uint32_t last = heap.back();
+    heap.pop_back();
+    if (pos == heap.size())
+        return;
+    heap[pos] = last;
+    if (pos > 0 and heap[(pos - 1)/2] > last)
+        heapSiftUp(heap, pos);
+    else
+        heapSiftDown(heap, pos);
+}
+
+void Domain::updateTopi(unsigned slot)
+{
+    count(&DomainStats::topi_updates);
+    auto& idc = idcs_[slot];
+    const auto& heap = topi_heaps_[slot];
+    Topi topi{};
+    if (not heap.empty()) {
+        unsigned priority = heap.front() >> 10;
+        bool under_threshold = idc.ithreshold == 0 or priority < idc.ithreshold;
+        if (under_threshold) {
             topi.fields.priority = priority;
-            topi.fields.iid = i;
+            topi.fields.iid = heap.front() & 0x3ff;
         }
         topi.legalize();
     }
+    if ((topi.value == 0) != (idc.topi.value == 0))
+        markXeipDirty(slot);
+    storeRelaxed(idc.topi.value, topi.value);
 }
 
-void Domain::inferXeipBits()
+void Domain::updateTopiSource(unsigned i)
 {
-    for (unsigned i : hart_indices_)
-        xeip_bits_[i] = 0;
-    if (domaincfg_.fields.ie) {
-        for (unsigned hart_index : hart_indices_) {
-            if (idcs_[hart_index].iforce)
-                xeip_bits_[hart_index] = 1;
-        }
-        unsigned num_sources = aplic_->numSources();
-        for (unsigned i = 1; i <= num_sources; i++) {
-            unsigned hart_index = target_[i].dm0.hart_index;
-            if (not includesHart(hart_index))
-                continue;
-            unsigned priority = target_[i].dm0.iprio;
-            unsigned idelivery = idcs_[hart_index].idelivery;
-            unsigned ithreshold = idcs_[hart_index].ithreshold;
-            bool under_threshold = ithreshold == 0 or priority < ithreshold;
-            //std::cerr << "idelivery: " << idelivery << ", under_threshold: " << under_threshold << ", pending: " << pending(i) << ", enabled: " << enabled(i) << ")\n";
-            if (idelivery and under_threshold and pending(i) and enabled(i))
-                xeip_bits_[hart_index] = 1;
-        }
+    unsigned slot = topiSlot(i);
+    if (heap_pos_[i] != not_in_heap) {
+        unsigned old_slot = heap_slot_[i];
+        heapRemove(i);
+        if (old_slot != slot)
+            updateTopi(old_slot);
+    }
+    if (slot != no_slot) {
+        heapInsert(slot, i);
+        updateTopi(slot);
+    }
+}
+
+void Domain::rebuildTopi()
+{
+    for (auto& heap : topi_heaps_)
+        heap.clear();
+    std::fill(heap_pos_.begin(), heap_pos_.end(), not_in_heap);
+    unsigned num_sources = aplic_->numSources();
+    for (unsigned i = 1; i <= num_sources; i++) {
+        unsigned slot = topiSlot(i);
+        if (slot != no_slot)
+            heapInsert(slot, i);
+    }
+    for (unsigned slot = 0; slot < topi_heaps_.size(); slot++)
+        updateTopi(slot);
+}
+
+bool Domain::inferXeip(unsigned slot) const
+{
+    if (not domaincfg_.fields.ie)
+        return false;
+    const auto& idc = idcs_[slot];
+    return idc.iforce or (idc.idelivery and idc.topi.value != 0);
+}
+
+void Domain::deliverXeip(unsigned slot)
+{
+    uint8_t xeip_bit = inferXeip(slot);
+    if (xeip_bits_[slot] == xeip_bit)
+        return;
+    xeip_bits_[slot] = xeip_bit;
+    if (trace_) [[unlikely]]
+        trace_->record(TraceOp::DirectDelivery, hart_indices_[slot], xeip_bit, privilege_);
+    if (not sink_)
+        return;
+    count(&DomainStats::direct_deliveries);
+    sink_->deliverDirect(hart_indices_[slot], privilege_, xeip_bit);
+}
+
+// The counters of DomainStats other than reads and writes.
+static constexpr uint64_t DomainStats::* stats_counters[] = {
+    &DomainStats::edges, &DomainStats::set_ips, &DomainStats::clear_ips,
+    &DomainStats::topi_updates, &DomainStats::delivery_passes,
+    &DomainStats::direct_deliveries,
+    &DomainStats::msis_forwarded, &DomainStats::genmsi_sends,
+    &DomainStats::claims, &DomainStats::spurious_claims,
+};
+
+DomainStats Domain::stats() const
+{
+    DomainStats stats;
+    auto load = [](const uint64_t& value) {
+        return std::atomic_ref(const_cast<uint64_t&>(value)).load(std::memory_order_relaxed);
+    };
+    for (unsigned c = 0; c < NumRegClasses; c++) {
+        stats.reads[c] = load(stats_.reads[c]);
+        stats.writes[c] = load(stats_.writes[c]);
+    }
+    for (auto counter : stats_counters)
+        stats.*counter = load(stats_.*counter);
+    return stats;
+}
+
+void Domain::resetStats()
+{
+    auto clear = [](uint64_t& value) { std::atomic_ref(value).store(0, std::memory_order_relaxed); };
+    for (unsigned c = 0; c < NumRegClasses; c++) {
+        clear(stats_.reads[c]);
+        clear(stats_.writes[c]);
+    }
+    for (auto counter : stats_counters)
+        clear(stats_.*counter);
+}
+
+RegClass Domain::regClass(uint64_t offset)
+{
+    switch (offset) {
+        case 0x0000: return DomaincfgReg;
+        case 0x1bc0:
+        case 0x1bc4:
+        case 0x1bc8:
+        case 0x1bcc: return MsiaddrcfgReg;
+        case 0x1cdc:
+        case 0x1ddc:
+        case 0x2000:
+        case 0x2004: return PendingReg;
+        case 0x1edc:
+        case 0x1fdc: return EnableReg;
+        case 0x3000: return GenmsiReg;
     }
+    if (offset >= 0x0004 and offset <= 0x0ffc)
+        return SourcecfgReg;
+    if ((offset >= 0x1c00 and offset <= 0x1c7c) or (offset >= 0x1d00 and offset <= 0x1d7c))
+        return PendingReg;
+    if ((offset >= 0x1e00 and offset <= 0x1e7c) or (offset >= 0x1f00 and offset <= 0x1f7c))
+        return EnableReg;
+    if (offset >= 0x3004 and offset <= 0x3ffc)
+        return TargetReg;
+    if (offset >= 0x4000) {
+        unsigned idc_offset = (offset - 0x4000) % 32;
+        if (idc_offset <= 0x08 or idc_offset >= 0x18)
+            return IdcReg;
+    }
+    return ReservedReg;
+}
+
+void Domain::traceMsi(uint64_t addr, uint32_t data)
+{
+    trace_->record(TraceOp::MsiDelivery, addr, data);
 }
 
 void Domain::runCallbacksAsRequired()
 {
+    if (not subtree_dirty_.load(std::memory_order_relaxed) or aplic_->inBatch())
+        return;
+    if (not sink_ or not sink_->batchesMsis()) {
+        runCallbacksAsRequired(nullptr);
+        return;
+    }
+    // Collect this pass's MSIs, then deliver each run of them for the same
+    // sink together. The buffers are moved out while in use in case a sink
+    // starts another pass.
+    MsiBatch batch = std::move(msi_batch_);
+    batch.msis.clear();
+    batch.sinks.clear();
+    runCallbacksAsRequired(&batch);
+    std::span<const std::pair<uint64_t, uint32_t>> msis = batch.msis;
+    for (size_t begin = 0, end; begin < msis.size(); begin = end) {
+        DeliverySink* sink = batch.sinks[begin];
+        for (end = begin + 1; end < msis.size() and batch.sinks[end] == sink; end++)
+            ;
+        if (end - begin > 1 and sink->batchesMsis()) {
+            sink->deliverMsis(msis.subspan(begin, end - begin));
+        } else {
+            for (size_t k = begin; k < end; k++)
+                sink->deliverMsi(msis[k].first, msis[k].second);
+        }
+    }
+    msi_batch_ = std::move(batch);
+}
+
+void Domain::runCallbacksAsRequired(MsiBatch* batch)
+{
+    if (not subtree_dirty_.load(std::memory_order_relaxed))
+        return;
+    if (dirty_)
+        runOwnCallbacks(batch);
+    bool still_dirty = dirty_;
+    for (auto& child : children_) {
+        child->runCallbacksAsRequired(batch);
+        still_dirty |= child->subtree_dirty_.load(std::memory_order_relaxed);
+    }
+    subtree_dirty_.store(still_dirty, std::memory_order_relaxed);
+}
+
+void Domain::runOwnCallbacks(MsiBatch* batch)
+{
+    count(&DomainStats::delivery_passes);
     if (domaincfg_.fields.dm == Direct) {
-        auto prev_xeip_bits = xeip_bits_;
-        inferXeipBits();
-        for (unsigned hart_index : hart_indices_) {
-            auto xeip_bit = xeip_bits_[hart_index];
-            if (prev_xeip_bits[hart_index] != xeip_bit and direct_callback_)
-                direct_callback_(hart_index, privilege_, xeip_bit);
+        if (xeip_all_dirty_) {
+            for (unsigned slot = 0; slot < idcs_.size(); slot++)
+                deliverXeip(slot);
+        } else {
+            // keep callbacks in hart_indices_ order, which is slot order
+            std::sort(xeip_dirty_slots_.begin(), xeip_dirty_slots_.end());
+            for (size_t k = 0; k < xeip_dirty_slots_.size(); k++)
+                deliverXeip(xeip_dirty_slots_[k]);
         }
     } else if (aplic_->autoForwardViaMsi) {
-        unsigned num_sources = aplic_->numSources();
-        for (unsigned i = 0; i <= num_sources; i++) {
+        if (readyToForwardViaMsi(0))
+            forwardViaMsi(0, batch);
+        for (unsigned i = nextReadySource(1); i != 0; i = nextReadySource(i + 1)) {
             if (readyToForwardViaMsi(i))
-                forwardViaMsi(i);
+                forwardViaMsi(i, batch);
         }
     }
-    for (auto child : children_)
-        child->runCallbacksAsRequired();
+    for (unsigned slot : xeip_dirty_slots_)
+        xeip_dirty_[slot] = 0;
+    xeip_dirty_slots_.clear();
+    xeip_all_dirty_ = false;
+    // Without auto-forwarding, ready sources stay pending; keep the domain
+    // dirty so they are forwarded by the first pass after it is re-enabled.
+    dirty_ = domaincfg_.fields.dm == MSI and not aplic_->autoForwardViaMsi;
 }
 
-uint64_t Domain::msiAddr(unsigned hart_index, unsigned guest_index) const
+size_t Domain::stateSize() const
 {
-    uint64_t addr = 0;
-    auto cfgh = root()->mmsiaddrcfgh_;
-    uint64_t g = (hart_index >> cfgh.fields.lhxw) & ((1 << cfgh.fields.hhxw) - 1);
-    uint64_t h = hart_index & ((1 << cfgh.fields.lhxw) - 1);
-    uint64_t hhxs = cfgh.fields.hhxs;
-    if (privilege_ == Machine) {
-        uint64_t low = root()->mmsiaddrcfg_;
-        addr = (uint64_t(cfgh.fields.ppn) << 32) | low;
-        addr = (addr | (g << (hhxs + 12)) | (h << cfgh.fields.lhxs)) << 12;
-    } else {
-        auto scfgh = root()->smsiaddrcfgh_;
-        uint64_t low = root()->smsiaddrcfg_;
-        addr = (uint64_t(scfgh.fields.ppn) << 32) | low;
-        addr = (addr | (g << (hhxs + 12)) | (h << scfgh.fields.lhxs) | guest_index) << 12;
+    size_t num_sources = aplic_->numSources();
+    size_t num_words = num_sources/32 + 1;
+    return 8 + 2*num_sources + 2*num_words + 4*idcs_.size();
+}
+
+void Domain::saveState(std::vector<uint32_t>& state) const
+{
+    state.push_back(idcs_.size());
+    state.push_back(children_.size());
+    state.push_back(domaincfg_.value);
+    state.push_back(mmsiaddrcfg_);
+    state.push_back(mmsiaddrcfgh_.value);
+    state.push_back(smsiaddrcfg_);
+    state.push_back(smsiaddrcfgh_.value);
+    state.push_back(genmsi_.value);
+    unsigned num_sources = aplic_->numSources();
+    for (unsigned i = 1; i <= num_sources; i++)
+        state.push_back(sourcecfg_[i].value);
+    for (unsigned i = 1; i <= num_sources; i++)
+        state.push_back(target_[i].value);
+    for (unsigned w = 0; w <= num_sources/32; w++) {
+        state.push_back(setip_[w]);
+        state.push_back(setie_[w]);
+    }
+    for (unsigned slot = 0; slot < idcs_.size(); slot++) {
+        const auto& idc = idcs_[slot];
+        state.push_back(idc.idelivery);
+        state.push_back(idc.iforce);
+        state.push_back(idc.ithreshold);
+        state.push_back(xeip_bits_[slot]);
     }
-    return addr;
 }
 
-bool Domain::rectifiedInputValue(unsigned i) const
+bool Domain::stateMatches(const uint32_t* state) const
 {
-    if (not sourceIsActive(i))
-        return false;
-    bool state = aplic_->getSourceState(i);
-    switch (sourcecfg_[i].d0.sm) {
-        case Detached:
-            return false;
-        case Edge1:
-        case Level1:
-            return state;
-        case Edge0:
-        case Level0:
-            return not state;
+    return state[0] == idcs_.size() and state[1] == children_.size();
+}
+
+void Domain::restoreState(const uint32_t* state)
+{
+    assert(stateMatches(state));
+    state += 2;
+    storeRelaxed(domaincfg_.value, *state++);
+    mmsiaddrcfg_ = *state++;
+    mmsiaddrcfgh_.value = *state++;
+    smsiaddrcfg_ = *state++;
+    smsiaddrcfgh_.value = *state++;
+    genmsi_.value = *state++;
+    unsigned num_sources = aplic_->numSources();
+    auto sourcecfgs = sourcecfg_.mutAll();
+    for (unsigned i = 1; i <= num_sources; i++) {
+        storeRelaxed(sourcecfgs[i].value, *state++);
+        updateSourceMasks(i);
     }
-    assert(false);
-    return false;
+    auto targets = target_.mutAll();
+    for (unsigned i = 1; i <= num_sources; i++)
+        targets[i].value = *state++;
+    ready_words_ = 0;
+    for (unsigned w = 0; w < setip_.size(); w++) {
+        bool saved = w <= num_sources/32;
+        setip_[w] = saved ? *state++ : 0;
+        setie_[w] = saved ? *state++ : 0;
+        if (setip_[w] & setie_[w])
+            ready_words_ |= 1u << w;
+    }
+    for (unsigned slot = 0; slot < idcs_.size(); slot++) {
+        auto& idc = idcs_[slot];
+        idc.idelivery = *state++;
+        idc.iforce = *state++;
+        idc.ithreshold = *state++;
+        xeip_bits_[slot] = *state++;
+    }
+
+    rebuildTopi();
+    for (unsigned slot : xeip_dirty_slots_)
+        xeip_dirty_[slot] = 0;
+    xeip_dirty_slots_.clear();
+    xeip_all_dirty_ = false;
+    dirty_ = false;
+    subtree_dirty_.store(false, std::memory_order_relaxed);
+
+    // Some writes, such as to genmsi, leave delivery to the next pass. Mark
+    // whatever that pass could deliver; the saved xeip bits are what the
+    // harts were last given.
+    if (domaincfg_.fields.dm == MSI) {
+        if (genmsi_.fields.busy or ready_words_ or not aplic_->autoForwardViaMsi)
+            markDirty();
+    } else {
+        for (unsigned slot = 0; slot < idcs_.size(); slot++)
+            if (inferXeip(slot) != bool(xeip_bits_[slot]))
+                markXeipDirty(slot);
+    }
+}
+
+MsiAddrGeometry::MsiAddrGeometry(uint32_t mmsiaddrcfg, Mmsiaddrcfgh mmsiaddrcfgh, uint32_t smsiaddrcfg, Smsiaddrcfgh smsiaddrcfgh)
+{
+    m_base = ((uint64_t(mmsiaddrcfgh.fields.ppn) << 32) | mmsiaddrcfg) << 12;
+    s_base = ((uint64_t(smsiaddrcfgh.fields.ppn) << 32) | smsiaddrcfg) << 12;
+    lhxw = mmsiaddrcfgh.fields.lhxw;
+    lhx_mask = (1u << mmsiaddrcfgh.fields.lhxw) - 1;
+    hhx_mask = (1u << mmsiaddrcfgh.fields.hhxw) - 1;
+    hhx_shift = mmsiaddrcfgh.fields.hhxs + 24;
+    m_lhx_shift = mmsiaddrcfgh.fields.lhxs + 12;
+    s_lhx_shift = smsiaddrcfgh.fields.lhxs + 12;
+}
+
+uint64_t Domain::msiAddr(unsigned hart_index, unsigned guest_index) const
+{
+    return aplic_->msi_geometry_.addr(privilege_, hart_index, guest_index);
+}
+
+void Domain::updateMsiGeometry()
+{
+    aplic_->updateMsiGeometry();
+}
+
+void Domain::setSourceOwner(unsigned i, Domain* owner)
+{
+    if (i < aplic_->source_owners_.size())
+        aplic_->source_owners_[i] = owner;
 }
 
 bool Domain::sourceIsImplemented(unsigned i) const
 {
     if (i == 0 or i > aplic_->numSources())
         return false;
-    if (parent() and not parent()->sourcecfg_[i].dx.d)
+    if (parent_ and not parent_->sourcecfg_[i].dx.d)
+        return false;
+    if (parent_ and parent_->sourcecfg_[i].d1.child_index != child_index_)
         return false;
     return true;
 }
-
-std::shared_ptr<Domain> Domain::root() const { return aplic_->root(); }
@@ -3,7 +3,13 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <functional>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <span>
 #include <vector>
@@ -19,6 +25,87 @@ enum Privilege {
 
 typedef std::function<bool(unsigned hart_index, Privilege privilege, bool xeip)> DirectDeliveryCallback;
 typedef std::function<bool(uint64_t addr, uint32_t data)> MsiDeliveryCallback;
+typedef std::function<bool(std::span<const std::pair<uint64_t, uint32_t>> msis)> MsiBatchDeliveryCallback;
+
+// Receives the deliveries of an Aplic: changes of a hart's external
+// interrupt line (direct mode) and MSI writes (MSI mode).
+class DeliverySink
+{
+public:
+    virtual ~DeliverySink() = default;
+    virtual bool deliverDirect(unsigned hart_index, Privilege privilege, bool xeip) = 0;
+    virtual bool deliverMsi(uint64_t addr, uint32_t data) = 0;
+
+    // When batchesMsis returns true, the MSIs produced by one operation
+    // (a register write, a source state change, a commit, ...) are collected
+    // and, if there is more than one, passed to deliverMsis together, in the
+    // order they would otherwise have been delivered.
+    virtual bool batchesMsis() const { return false; }
+
+    virtual bool deliverMsis(std::span<const std::pair<uint64_t, uint32_t>> msis)
+    {
+        bool ok = true;
+        for (auto [addr, data] : msis)
+            ok &= deliverMsi(addr, data);
+        return ok;
+    }
+};
+
+// Adapts an object of a known class to DeliverySink without requiring it to
+// derive from it. Impl provides deliverDirect and/or deliverMsi with the
+// signatures above; they need not be virtual, and are called directly so
+// they can be inlined into the adapter. Domain calls the adapter through
+// DeliverySink, one virtual call per delivery. Deliveries Impl has no
+// member for are dropped.
+template <class Impl>
+class DeliverySinkAdapter final : public DeliverySink
+{
+public:
+    explicit DeliverySinkAdapter(Impl& impl) : impl_(impl) {}
+
+    bool deliverDirect(unsigned hart_index, Privilege privilege, bool xeip) override
+    {
+        if constexpr (requires { impl_.deliverDirect(hart_index, privilege, xeip); })
+            return impl_.deliverDirect(hart_index, privilege, xeip);
+        return false;
+    }
+
+    bool deliverMsi(uint64_t addr, uint32_t data) override
+    {
+        if constexpr (requires { impl_.deliverMsi(addr, data); })
+            return impl_.deliverMsi(addr, data);
+        return false;
+    }
+
+private:
+    Impl& impl_;
+};
+
+// The DeliverySink used by the std::function callback setters.
+class CallbackSink final : public DeliverySink
+{
+public:
+    bool deliverDirect(unsigned hart_index, Privilege privilege, bool xeip) override
+    {
+        return direct_callback ? direct_callback(hart_index, privilege, xeip) : false;
+    }
+
+    bool deliverMsi(uint64_t addr, uint32_t data) override
+    {
+        return msi_callback ? msi_callback(addr, data) : false;
+    }
+
+    bool batchesMsis() const override { return bool(msi_batch_callback); }
+
+    bool deliverMsis(std::span<const std::pair<uint64_t, uint32_t>> msis) override
+    {
+        return msi_batch_callback(msis);
+    }
+
+    DirectDeliveryCallback direct_callback = nullptr;
+    MsiDeliveryCallback msi_callback = nullptr;
+    MsiBatchDeliveryCallback msi_batch_callback = nullptr;
+};
 
 enum SourceMode {
     Inactive,
@@ -69,6 +156,31 @@ union Smsiaddrcfgh {
     } fields;
 };
 
+// The MSI address geometry given by the root domain's m/smsiaddrcfg(h)
+// registers, decoded so that an address takes a few shifts and masks.
+struct MsiAddrGeometry {
+    uint64_t m_base = 0;         // machine-level base address
+    uint64_t s_base = 0;         // supervisor-level base address
+    unsigned lhxw = 0;
+    uint32_t lhx_mask = 0;
+    uint32_t hhx_mask = 0;
+    unsigned hhx_shift = 24;     // hhxs + 24
+    unsigned m_lhx_shift = 12;   // lhxs + 12
+    unsigned s_lhx_shift = 12;
+
+    MsiAddrGeometry() = default;
+
+    MsiAddrGeometry(uint32_t mmsiaddrcfg, Mmsiaddrcfgh mmsiaddrcfgh, uint32_t smsiaddrcfg, Smsiaddrcfgh smsiaddrcfgh);
+
+    uint64_t addr(Privilege privilege, unsigned hart_index, unsigned guest_index) const {
+        uint64_t g = (hart_index >> lhxw) & hhx_mask;
+        uint64_t h = hart_index & lhx_mask;
+        if (privilege == Machine)
+            return m_base | (g << hhx_shift) | (h << m_lhx_shift);
+        return s_base | (g << hhx_shift) | (h << s_lhx_shift) | (uint64_t(guest_index) << 12);
+    }
+};
+
 union Target {
     uint32_t value = 0;
 
@@ -197,7 +309,61 @@ union Genmsi {
     } fields;
 };
 
+// A fixed-size array whose elements are shared by the copies of an Aplic
+// made by Aplic::fork until one of them writes to it. Reads go through
+// operator[], writes through mut.
+template <typename T>
+class CowVector
+{
+public:
+    CowVector() = default;
+
+    explicit CowVector(size_t size, const T& value = T{})
+        : data_(std::make_shared<std::vector<T>>(size, value)), elems_(data_->data()), size_(size) {}
+
+    size_t size() const { return size_; }
+
+    const T& operator[](size_t i) const { return elems_[i]; }
+
+    T& mut(size_t i) { detach(); return elems_[i]; }
+
+    // All elements, detached once, for writing the whole array.
+    std::span<T> mutAll() { detach(); return {elems_, size_}; }
+
+    // Sets every element, un-sharing without a copy. The fence is that of
+    // detach.
+    void fill(const T& value)
+    {
+        if (data_.use_count() > 1) {
+            data_ = std::make_shared<std::vector<T>>(size_, value);
+            elems_ = data_->data();
+        } else {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            std::fill(elems_, elems_ + size_, value);
+        }
+    }
+
+    // Gives this copy elements of its own if they are shared. When no other
+    // copy holds them, the fence orders the other copies' last reads, made
+    // before they let go, before our writes.
+    void detach()
+    {
+        if (data_.use_count() > 1) {
+            data_ = std::make_shared<std::vector<T>>(*data_);
+            elems_ = data_->data();
+        } else {
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+    }
+
+private:
+    std::shared_ptr<std::vector<T>> data_;
+    T* elems_ = nullptr;
+    size_t size_ = 0;
+};
+
 class Aplic;
+class TraceRecorder;
 
 struct DomainParams {
     std::string name;
@@ -215,22 +381,73 @@ struct DomainParams {
     bool be_supported = true;
 };
 
-class Domain
+#ifdef APLIC_ENABLE_STATS
+constexpr bool stats_enabled = true;
+#else
+constexpr bool stats_enabled = false;
+#endif
+
+// The register classes whose reads and writes DomainStats counts.
+enum RegClass {
+    DomaincfgReg,    // domaincfg
+    SourcecfgReg,    // sourcecfg[i]
+    MsiaddrcfgReg,   // mmsiaddrcfg(h), smsiaddrcfg(h)
+    PendingReg,      // setip, setipnum(_le/_be), in_clrip, clripnum
+    EnableReg,       // setie, setienum, clrie, clrienum
+    GenmsiReg,       // genmsi
+    TargetReg,       // target[i]
+    IdcReg,          // idelivery, iforce, ithreshold, topi, claimi
+    ReservedReg,     // everything else
+    NumRegClasses,
+};
+
+// What a domain has done since it was created or its stats were reset.
+// Only counted if APLIC_ENABLE_STATS is defined, which must be the same for
+// every translation unit that includes this header; otherwise always zero.
+struct DomainStats {
+    std::array<uint64_t, NumRegClasses> reads {};
+    std::array<uint64_t, NumRegClasses> writes {};
+    uint64_t edges = 0;               // input changes of its sources
+    uint64_t set_ips = 0;             // pending bits set
+    uint64_t clear_ips = 0;           // pending bits cleared
+    uint64_t topi_updates = 0;        // topi recomputations
+    uint64_t delivery_passes = 0;     // passes that evaluated its deliveries
+    uint64_t direct_deliveries = 0;   // xeip changes given to the sink
+    uint64_t msis_forwarded = 0;      // MSIs sent for sources
+    uint64_t genmsi_sends = 0;        // MSIs sent for genmsi
+    uint64_t claims = 0;              // claimi reads returning an interrupt
+    uint64_t spurious_claims = 0;     // claimi reads returning 0
+
+    bool operator==(const DomainStats&) const = default;
+};
+
+class Domain : public std::enable_shared_from_this<Domain>
 {
     friend Aplic;
 
 public:
 
     const std::string& name() const { return name_; }
-    std::shared_ptr<Domain> root() const;
-    std::shared_ptr<Domain> parent() const { return parent_.lock(); }
+    std::shared_ptr<Domain> root() const { return root_->shared_from_this(); }
+    std::shared_ptr<Domain> parent() const { return parent_ ? parent_->shared_from_this() : nullptr; }
 
     uint64_t base() const { return base_; }
     uint64_t size() const { return size_; }
     Privilege privilege() const { return privilege_; }
     std::span<const unsigned> hartIndices() const { return hart_indices_; }
-    bool includesHart(unsigned hart_index) const {
-        return std::find(hart_indices_.begin(), hart_indices_.end(), hart_index) != hart_indices_.end();
+    bool includesHart(unsigned hart_index) const { return hartSlot(hart_index) != no_slot; }
+
+    static constexpr unsigned no_slot = ~0u;
+
+    /// Return the position of the given hart in hartIndices(), or no_slot if
+    /// the hart is not in this domain. Constant time.
+    unsigned hartSlot(unsigned hart_index) const
+    {
+        unsigned offset = hart_index - hart_slot_base_;
+        if (offset >= hart_slot_table_.size())
+            return no_slot;
+        uint16_t slot = hart_slot_table_[offset];
+        return slot == no_hart_slot ? no_slot : slot;
     }
 
     size_t numChildren() const { return children_.size(); }
@@ -252,17 +469,28 @@ public:
         return false;
     }
 
-    uint32_t readDomaincfg() const { return domaincfg_.value; }
+    // Counters may miss increments made concurrently by lock-free reads
+    // in thread-safe mode.
+    DomainStats stats() const;
+    void resetStats();
+
+    uint32_t readDomaincfg() const { return loadRelaxed(domaincfg_.value); }
 
     void writeDomaincfg(uint32_t value) {
-        domaincfg_.value = value;
-        domaincfg_.legalize(dm0_ok_, dm1_ok_, be0_ok_, be1_ok_);
+        auto prev_dm = domaincfg_.fields.dm;
+        Domaincfg domaincfg{value};
+        domaincfg.legalize(dm0_ok_, dm1_ok_, be0_ok_, be1_ok_);
+        storeRelaxed(domaincfg_.value, domaincfg.value);
         if (domaincfg_.fields.dm == Direct)
           genmsi_.value = 0;
+        if (domaincfg_.fields.dm != prev_dm)
+            rebuildTopi();
+        xeip_all_dirty_ = true;
+        markDirty();
         runCallbacksAsRequired();
     }
 
-    uint32_t readSourcecfg(unsigned i) const { return sourcecfg_.at(i).value; }
+    uint32_t readSourcecfg(unsigned i) const { return i < sourcecfg_.size() ? loadRelaxed(sourcecfg_[i].value) : 0; }
 
     void writeSourcecfg(unsigned i, uint32_t value) {
         if (not sourceIsImplemented(i))
@@ -272,22 +500,26 @@ public:
 
         auto old_sourcecfg = sourcecfg_[i];
 
-        std::shared_ptr<Domain> new_child = new_sourcecfg.dx.d ? children_[new_sourcecfg.d1.child_index] : nullptr;
-        std::shared_ptr<Domain> old_child = old_sourcecfg.dx.d ? children_[old_sourcecfg.d1.child_index] : nullptr;
+        Domain* new_child = new_sourcecfg.dx.d ? children_[new_sourcecfg.d1.child_index].get() : nullptr;
+        Domain* old_child = old_sourcecfg.dx.d ? children_[old_sourcecfg.d1.child_index].get() : nullptr;
 
         if (old_child and new_child != old_child)
             old_child->undelegate(i);
 
         bool source_was_active = sourceIsActive(i);
-        sourcecfg_[i] = new_sourcecfg;
+        storeRelaxed(sourcecfg_.mut(i).value, new_sourcecfg.value);
+        updateSourceMasks(i);
+        if (new_child != old_child)
+            setSourceOwner(i, new_child ? new_child : this);
         bool source_is_active = sourceIsActive(i);
 
         if (not source_is_active) {
-            target_[i].value = 0;
+            target_.mut(i).value = 0;
+            updateMsiAddr(i);
             clearIe(i);
             clearIp(i);
         } else if (not source_was_active and domaincfg_.fields.dm == Direct) {
-            target_[i].dm0.iprio = 1;
+            target_.mut(i).dm0.iprio = 1;
         }
 
         // source may becoming pending under new source mode
@@ -303,24 +535,25 @@ public:
     uint32_t readMmsiaddrcfg() const {
         if (privilege_ != Machine)
             return 0;
-        if (parent())
-            return root()->mmsiaddrcfg_;
+        if (parent_)
+            return root_->mmsiaddrcfg_;
         return mmsiaddrcfg_;
     }
 
     void writeMmsiaddrcfg(uint32_t value) {
-        if (parent())
+        if (parent_)
             return;
         if (mmsiaddrcfgh_.fields.l)
             return;
         mmsiaddrcfg_ = value;
+        updateMsiGeometry();
     }
 
     uint32_t readMmsiaddrcfgh() const {
         if (privilege_ != Machine)
             return 0;
-        if (parent()) {
-            auto mmsiaddrcfgh = root()->mmsiaddrcfgh_;
+        if (parent_) {
+            auto mmsiaddrcfgh = root_->mmsiaddrcfgh_;
             mmsiaddrcfgh.fields.l = 1;
             return mmsiaddrcfgh.value;
         }
@@ -328,55 +561,55 @@ public:
     }
 
     void writeMmsiaddrcfgh(uint32_t value) {
-        if (parent())
+        if (parent_)
             return;
         if (mmsiaddrcfgh_.fields.l)
             return;
         mmsiaddrcfgh_.value = value;
         mmsiaddrcfgh_.legalize();
+        updateMsiGeometry();
     }
 
     uint32_t readSmsiaddrcfg() const {
         if (privilege_ != Machine)
             return 0;
-        if (parent())
-            return root()->smsiaddrcfg_;
+        if (parent_)
+            return root_->smsiaddrcfg_;
         return smsiaddrcfg_;
     }
 
     void writeSmsiaddrcfg(uint32_t value) {
-        if (parent())
+        if (parent_)
             return;
         if (mmsiaddrcfgh_.fields.l)
             return;
         smsiaddrcfg_ = value;
+        updateMsiGeometry();
     }
 
     uint32_t readSmsiaddrcfgh() const {
         if (privilege_ != Machine)
             return 0;
-        if (parent())
-            return root()->smsiaddrcfgh_.value;
+        if (parent_)
+            return root_->smsiaddrcfgh_.value;
         return smsiaddrcfgh_.value;
     }
 
     void writeSmsiaddrcfgh(uint32_t value) {
-        if (parent())
+        if (parent_)
             return;
         if (mmsiaddrcfgh_.fields.l)
             return;
         smsiaddrcfgh_.value = value;
         smsiaddrcfgh_.legalize();
+        updateMsiGeometry();
     }
 
     uint32_t readSetip(unsigned i) const { return setip_.at(i); }
 
     void writeSetip(unsigned i, uint32_t value) {
         assert(i < 32);
-        for (unsigned j = 0; j < 32; j++) {
-            if ((value >> j) & 1)
-                trySetIp(i*32+j);
-        }
+        trySetIpWord(i, value);
         runCallbacksAsRequired();
     }
 
@@ -389,20 +622,12 @@ public:
 
     uint32_t readInClrip(unsigned i) const {
         assert(i < 32);
-        uint32_t result = 0;
-        for (unsigned j = 0; j < 32; j++) {
-            uint32_t bit = uint32_t(rectifiedInputValue(i*32+j));
-            result |= bit << j;
-        }
-        return result;
+        return rectifiedInputWord(i);
     }
 
     void writeInClrip(unsigned i, uint32_t value) {
         assert(i < 32);
-        for (unsigned j = 0; j < 32; j++) {
-            if ((value >> j) & 1)
-                tryClearIp(i*32+j);
-        }
+        tryClearIpWord(i, value);
         runCallbacksAsRequired();
     }
 
@@ -417,10 +642,7 @@ public:
 
     void writeSetie(unsigned i, uint32_t value) {
         assert(i < 32);
-        for (unsigned j = 0; j < 32; j++) {
-            if ((value >> j) & 1)
-                setIe(i*32+j);
-        }
+        writeIeWord(i, setie_[i] | (value & activeMask(i)));
         runCallbacksAsRequired();
     }
 
@@ -435,10 +657,7 @@ public:
 
     void writeClrie(unsigned i, uint32_t value) {
         assert(i < 32);
-        for (unsigned j = 0; j < 32; j++) {
-            if ((value >> j) & 1)
-                clearIe(i*32+j);
-        }
+        writeIeWord(i, setie_[i] & ~value);
         runCallbacksAsRequired();
     }
 
@@ -473,53 +692,85 @@ public:
         genmsi_.value = value;
         genmsi_.legalize(eiidlen_);
         genmsi_.fields.busy = 1;
+        markDirty();
     }
 
-    uint32_t readTarget(unsigned i) const { return target_.at(i).value; }
+    uint32_t readTarget(unsigned i) const { return i < target_.size() ? target_[i].value : 0; }
 
     void writeTarget(unsigned i, uint32_t value) {
         if (not sourceIsActive(i))
             return;
         Target target{value};
         target.legalize(privilege_, DeliveryMode(domaincfg_.fields.dm), ipriolen_, eiidlen_);
-        target_[i] = target;
-        updateTopi();
+        target_.mut(i) = target;
+        updateMsiAddr(i);
+        updateTopiSource(i);
         runCallbacksAsRequired();
     }
 
-    uint32_t readIdelivery(unsigned hart_index) const { return idcs_.at(hart_index).idelivery; }
+    // IDC registers of harts not in this domain are read-only zero.
+
+    uint32_t readIdelivery(unsigned hart_index) const {
+        unsigned slot = hartSlot(hart_index);
+        return slot == no_slot ? 0 : idcs_[slot].idelivery;
+    }
 
     void writeIdelivery(unsigned hart_index, uint32_t value) {
-        idcs_.at(hart_index).idelivery = value & 1;
+        unsigned slot = hartSlot(hart_index);
+        if (slot == no_slot)
+            return;
+        idcs_[slot].idelivery = value & 1;
+        markXeipDirty(slot);
         runCallbacksAsRequired();
     }
 
-    uint32_t readIforce(unsigned hart_index) const { return idcs_.at(hart_index).iforce; }
+    uint32_t readIforce(unsigned hart_index) const {
+        unsigned slot = hartSlot(hart_index);
+        return slot == no_slot ? 0 : idcs_[slot].iforce;
+    }
 
     void writeIforce(unsigned hart_index, uint32_t value) {
-        idcs_.at(hart_index).iforce = value & 1;
+        unsigned slot = hartSlot(hart_index);
+        if (slot == no_slot)
+            return;
+        idcs_[slot].iforce = value & 1;
+        markXeipDirty(slot);
         runCallbacksAsRequired();
     }
 
-    uint32_t readIthreshold(unsigned hart_index) const { return idcs_.at(hart_index).ithreshold; }
+    uint32_t readIthreshold(unsigned hart_index) const {
+        unsigned slot = hartSlot(hart_index);
+        return slot == no_slot ? 0 : idcs_[slot].ithreshold;
+    }
 
     void writeIthreshold(unsigned hart_index, uint32_t value) {
+        unsigned slot = hartSlot(hart_index);
+        if (slot == no_slot)
+            return;
         value &= (1 << ipriolen_) - 1;
-        idcs_.at(hart_index).ithreshold = value;
-        updateTopi();
+        idcs_[slot].ithreshold = value;
+        updateTopi(slot);
     }
 
-    uint32_t readTopi(unsigned hart_index) const { return idcs_.at(hart_index).topi.value; }
+    uint32_t readTopi(unsigned hart_index) const {
+        unsigned slot = hartSlot(hart_index);
+        return slot == no_slot ? 0 : loadRelaxed(idcs_[slot].topi.value);
+    }
 
     void writeTopi(unsigned /*hart_index*/, uint32_t /*value*/) {}
 
     uint32_t readClaimi(unsigned hart_index) {
-        auto topi = idcs_.at(hart_index).topi;
+        unsigned slot = hartSlot(hart_index);
+        if (slot == no_slot)
+            return 0;
+        auto topi = idcs_[slot].topi;
         if (domaincfg_.fields.dm == Direct) {
+            count(topi.value ? &DomainStats::claims : &DomainStats::spurious_claims);
             auto sm = sourcecfg_[topi.fields.iid].d0.sm;
-            if (topi.value == 0)
-                idcs_.at(hart_index).iforce = 0;
-            else if (sm == Detached or sm == Edge0 or sm == Edge1)
+            if (topi.value == 0) {
+                idcs_[slot].iforce = 0;
+                markXeipDirty(slot);
+            } else if (sm == Detached or sm == Edge0 or sm == Edge1)
                 clearIp(topi.fields.iid);
             runCallbacksAsRequired();
         }
@@ -530,10 +781,12 @@ public:
 
 private:
     Domain(
-        const Aplic *aplic,
-        std::shared_ptr<Domain> parent,
+        Aplic *aplic,
+        Domain* parent,
         const DomainParams& domain_params
     );
+    // A copy of other for a forked Aplic, sharing its per-source arrays.
+    Domain(Aplic* aplic, Domain* parent, const Domain& other);
     Domain(const Domain&) = delete;
     Domain& operator=(const Domain&) = delete;
 
@@ -542,11 +795,62 @@ private:
         uint64_t offset = addr - base_;
         bool is_setipnum_le = offset == 0x2000;
         bool is_setipnum_be = offset == 0x2004;
-        return (domaincfg_.fields.be or is_setipnum_be) and not is_setipnum_le;
+        Domaincfg domaincfg{loadRelaxed(domaincfg_.value)};
+        return (domaincfg.fields.be or is_setipnum_be) and not is_setipnum_le;
+    }
+
+    // In thread-safe mode domaincfg, sourcecfg and topi are read without
+    // taking the domain lock, so they are always loaded and stored as whole
+    // words. Everything else is only accessed with the lock held.
+    static uint32_t loadRelaxed(const uint32_t& value)
+    {
+        return std::atomic_ref(const_cast<uint32_t&>(value)).load(std::memory_order_relaxed);
+    }
+
+    static void storeRelaxed(uint32_t& dst, uint32_t value)
+    {
+        std::atomic_ref(dst).store(value, std::memory_order_relaxed);
+    }
+
+    // Adds n to a counter of stats_. Lock-free reads in thread-safe mode
+    // count too, so counters are updated atomically. Without
+    // APLIC_ENABLE_STATS this does nothing; stats_ is kept regardless so
+    // that Domain's layout does not depend on the macro.
+    void count([[maybe_unused]] uint64_t DomainStats::* counter, [[maybe_unused]] uint64_t n = 1)
+    {
+#ifdef APLIC_ENABLE_STATS
+        std::atomic_ref(stats_.*counter).fetch_add(n, std::memory_order_relaxed);
+#endif
+    }
+
+    using AccessCounts = std::array<uint64_t, NumRegClasses>;
+
+    void countAccess([[maybe_unused]] AccessCounts DomainStats::* counts, [[maybe_unused]] uint64_t addr)
+    {
+#ifdef APLIC_ENABLE_STATS
+        std::atomic_ref((stats_.*counts)[regClass(addr - base_)]).fetch_add(1, std::memory_order_relaxed);
+#endif
+    }
+
+    static RegClass regClass(uint64_t offset);
+
+    // True for the registers that thread-safe mode reads without a lock.
+    static bool isLockFreeRead(uint64_t offset)
+    {
+        if (offset == 0x0000 or (offset >= 0x0004 and offset <= 0x0ffc))
+            return true;
+        return offset >= 0x4000 and (offset - 0x4000) % 32 == 0x18;
+    }
+
+    // True for the registers whose reads have side effects.
+    static bool isClaimRead(uint64_t offset)
+    {
+        return offset >= 0x4000 and (offset - 0x4000) % 32 == 0x1c;
     }
 
     uint32_t read(uint64_t addr)
     {
+        countAccess(&DomainStats::reads, addr);
         uint32_t data = read_le(addr);
         if (use_be(addr))
             data = __builtin_bswap32(data);
@@ -594,8 +898,6 @@ private:
         } else if (offset >= 0x4000) {
             unsigned hart_index = (offset - 0x4000)/32;
             unsigned idc_offset = (offset - 0x4000) - 32*hart_index;
-            if (hart_index >= idcs_.size())
-                return 0;
             switch (idc_offset) {
                 case 0x00: return readIdelivery(hart_index);
                 case 0x04: return readIforce(hart_index);
@@ -610,6 +912,7 @@ private:
 
     void write(uint64_t addr, uint32_t data)
     {
+        countAccess(&DomainStats::writes, addr);
         if (use_be(addr))
             data = __builtin_bswap32(data);
         write_le(addr, data);
@@ -655,8 +958,6 @@ private:
         } else if (offset >= 0x4000) {
             unsigned hart_index = (offset - 0x4000)/32;
             unsigned idc_offset = (offset - 0x4000) - 32*hart_index;
-            if (hart_index >= idcs_.size())
-                return;
             switch (idc_offset) {
                 case 0x00: writeIdelivery(hart_index, data); return;
                 case 0x04: writeIforce(hart_index, data); return;
@@ -667,29 +968,46 @@ private:
         }
     }
 
-    void setDirectCallback(DirectDeliveryCallback callback)
-    {
-        direct_callback_ = callback;
-        for (auto child : children_)
-            child->setDirectCallback(callback);
-    }
-
-    void setMsiCallback(MsiDeliveryCallback callback)
+    // Delivers to the given sink, which is not owned and must outlive its
+    // use. The Aplic's callbacks are a sink too. nullptr disables delivery.
+    void setDeliverySink(DeliverySink* sink)
     {
-        msi_callback_ = callback;
-        for (auto child : children_)
-            child->setMsiCallback(callback);
+        sink_ = sink;
+        for (auto& child : children_)
+            child->setDeliverySink(sink);
     }
 
     void reset();
 
+    // Number of words that saveState appends.
+    size_t stateSize() const;
+
+    // Appends the registers and xeip bits of this domain to state.
+    void saveState(std::vector<uint32_t>& state) const;
+
+    // Whether a state saved from a domain with the same harts and children
+    // begins at state.
+    bool stateMatches(const uint32_t* state) const;
+
+    // Loads the state saved by saveState and rebuilds what is derived from
+    // it, without callbacks. MSI addresses and source owners are left to the
+    // Aplic.
+    void restoreState(const uint32_t* state);
+
     void edge(unsigned i)
+    {
+        applyEdge(i)->runCallbacksAsRequired();
+    }
+
+    // Updates pending state for a change of source i's input without
+    // running callbacks. Returns the domain that owns the source, which is
+    // marked dirty if anything changed.
+    Domain* applyEdge(unsigned i)
     {
         assert(i > 0 && i < 1024);
-        if (sourcecfg_[i].dx.d) {
-            children_[sourcecfg_[i].d1.child_index]->edge(i);
-            return;
-        }
+        if (sourcecfg_[i].dx.d)
+            return children_[sourcecfg_[i].d1.child_index]->applyEdge(i);
+        count(&DomainStats::edges);
         auto riv = rectifiedInputValue(i);
         auto sm = sourcecfg_[i].d0.sm;
         if (sm == Edge1 or sm == Edge0) {
@@ -701,15 +1019,77 @@ private:
             else
                 clearIp(i);
         }
-        runCallbacksAsRequired();
+        return this;
+    }
+
+    // Per-hart state (IDCs, topi heaps, xeip) is stored only for the harts
+    // of this domain, indexed by the hart's position ("slot") in
+    // hart_indices_. hart_slot_table_ maps hart_index - hart_slot_base_ to
+    // a slot for every hart index between the lowest and highest in the
+    // domain.
+    static constexpr uint16_t no_hart_slot = 0xffff;
+
+    // Each hart has a min-heap of the sources which are pending, enabled,
+    // and targeting it, keyed by (iprio, iid). This matches the spec's
+    // tie-break, so topi only needs to look at the top of the heap.
+    static constexpr uint16_t not_in_heap = 0xffff;
+
+    uint32_t topiKey(unsigned i) const { return (uint32_t(target_[i].dm0.iprio) << 10) | i; }
+
+    unsigned topiSlot(unsigned i) const;
+
+    void heapSiftUp(std::vector<uint32_t>& heap, size_t pos);
+
+    void heapSiftDown(std::vector<uint32_t>& heap, size_t pos);
+
+    void heapInsert(unsigned slot, unsigned i);
+
+    void heapRemove(unsigned i);
+
+    void updateTopi(unsigned slot);
+
+    void updateTopiSource(unsigned i);
+
+    void rebuildTopi();
+
+    // Harts whose xeip may have changed since the last delivery pass. The
+    // pass only re-evaluates these, unless every hart has been invalidated
+    // (e.g. by a domaincfg write).
+    void markXeipDirty(unsigned slot)
+    {
+        if (xeip_dirty_[slot])
+            return;
+        xeip_dirty_[slot] = 1;
+        xeip_dirty_slots_.push_back(slot);
+        markDirty();
     }
 
-    void updateTopi();
+    // Flags this domain for the next delivery pass, and its ancestors as
+    // having a dirty descendant, so passes can skip clean subtrees.
+    void markDirty()
+    {
+        dirty_ = true;
+        for (Domain* domain = this; domain and not domain->subtree_dirty_.load(std::memory_order_relaxed); domain = domain->parent_)
+            domain->subtree_dirty_.store(true, std::memory_order_relaxed);
+    }
+
+    bool inferXeip(unsigned slot) const;
+
+    void deliverXeip(unsigned slot);
 
-    void inferXeipBits();
+    // MSIs collected during a delivery pass, with the sink of the domain
+    // that produced each, for delivery at the end of the pass.
+    struct MsiBatch {
+        std::vector<std::pair<uint64_t, uint32_t>> msis;
+        std::vector<DeliverySink*> sinks;
+    };
 
     void runCallbacksAsRequired();
 
+    void runCallbacksAsRequired(MsiBatch* batch);
+
+    void runOwnCallbacks(MsiBatch* batch);
+
     bool readyToForwardViaMsi(unsigned i) const
     {
         if (domaincfg_.fields.dm != MSI)
@@ -719,90 +1099,205 @@ private:
         return domaincfg_.fields.ie and pending(i) and enabled(i);
     }
 
-    void forwardViaMsi(unsigned i) {
+    // Returns the lowest source at or after i that is both pending and
+    // enabled, or 0 if there is none. Words with no such source are skipped
+    // using ready_words_.
+    unsigned nextReadySource(unsigned i) const
+    {
+        unsigned w = i/32;
+        if (w >= 32)
+            return 0;
+        uint32_t bits = setip_[w] & setie_[w] & (~0u << (i % 32));
+        while (bits == 0) {
+            uint32_t later = w == 31 ? 0 : ready_words_ & (~0u << (w + 1));
+            if (later == 0)
+                return 0;
+            w = std::countr_zero(later);
+            bits = setip_[w] & setie_[w];
+        }
+        return w*32 + std::countr_zero(bits);
+    }
+
+    void forwardViaMsi(unsigned i, MsiBatch* batch = nullptr) {
         assert(readyToForwardViaMsi(i));
         if (i == 0) {
-            if (msi_callback_) {
+            if (sink_ or trace_) {
                 uint64_t addr = msiAddr(genmsi_.fields.hart_index, 0);
-                uint32_t data = genmsi_.fields.eiid;
-                msi_callback_(addr, data);
+                deliverMsi(addr, genmsi_.fields.eiid, &DomainStats::genmsi_sends, batch);
             }
             genmsi_.fields.busy = 0;
         } else {
-            if (msi_callback_) {
-                uint64_t addr = msiAddr(target_[i].dm1.hart_index, target_[i].dm1.guest_index);
-                uint32_t data = target_[i].dm1.eiid;
-                msi_callback_(addr, data);
-            }
+            if (sink_ or trace_)
+                deliverMsi(msi_addrs_[i], target_[i].dm1.eiid, &DomainStats::msis_forwarded, batch);
             clearIp(i);
         }
     }
 
+    // A trace records the MSI even if there is no sink to receive it.
+    void deliverMsi(uint64_t addr, uint32_t data, uint64_t DomainStats::* counter, MsiBatch* batch)
+    {
+        if (trace_) [[unlikely]]
+            traceMsi(addr, data);
+        if (not sink_)
+            return;
+        count(counter);
+        if (batch) {
+            batch->msis.push_back({addr, data});
+            batch->sinks.push_back(sink_);
+        } else {
+            sink_->deliverMsi(addr, data);
+        }
+    }
+
+    void traceMsi(uint64_t addr, uint32_t data);
+
     uint64_t msiAddr(unsigned hart_index, unsigned guest_index) const;
 
-    bool rectifiedInputValue(unsigned i) const;
+    void updateMsiAddr(unsigned i)
+    {
+        uint64_t addr = msiAddr(target_[i].dm1.hart_index, target_[i].dm1.guest_index);
+        if (msi_addrs_[i] != addr)
+            msi_addrs_.mut(i) = addr;
+    }
 
-    bool sourceIsImplemented(unsigned i) const;
+    // Called by the root domain when its MSI address registers change.
+    void updateMsiGeometry();
 
-    bool sourceIsActive(unsigned i) const
+    bool rectifiedInputValue(unsigned i) const
     {
         if (i == 0 or i >= 1024)
             return false;
-        if (sourcecfg_.at(i).dx.d)
-            return false;
-        return sourcecfg_.at(i).d0.sm != Inactive;
+        return (rectifiedInputWord(i/32) >> (i % 32)) & 1;
     }
 
-    void undelegate(unsigned i)
+    // Rectified input values for a word of 32 sources: the raw input,
+    // inverted for Edge0/Level0, and zero for inactive and detached sources.
+    uint32_t rectifiedInputWord(unsigned w) const
     {
-        assert(i > 0 && i < 1024);
-        if (sourcecfg_[i].dx.d) {
-            auto child = children_[sourcecfg_[i].d1.child_index];
-            child->undelegate(i);
-        }
-        sourcecfg_[i] = Sourcecfg{};
-        target_[i] = Target{};
-        clearIp(i);
-        clearIe(i);
+        uint32_t input = source_states_[w].load(std::memory_order_relaxed);
+        return (input ^ invert_mask_[w]) & activeMask(w) & ~detached_mask_[w];
     }
 
-    void trySetIp(unsigned i)
+    // Records in the Aplic that source i is now owned (not delegated further)
+    // by the given domain.
+    void setSourceOwner(unsigned i, Domain* owner);
+
+    bool sourceIsImplemented(unsigned i) const;
+
+    bool sourceIsActive(unsigned i) const
     {
-        if (not sourceIsActive(i))
+        if (i == 0 or i >= 1024)
+            return false;
+        return (activeMask(i/32) >> (i % 32)) & 1;
+    }
+
+    // Per 32-source word, which active sources are edge-sensitive (including
+    // detached) and which are level-sensitive. Kept in sync with sourcecfg_
+    // so bulk register writes can be done as masked word operations.
+    uint32_t activeMask(unsigned w) const { return edge_mask_[w] | level_mask_[w]; }
+
+    void updateSourceMasks(unsigned i)
+    {
+        uint32_t bit = 1u << (i % 32);
+        edge_mask_[i/32] &= ~bit;
+        level_mask_[i/32] &= ~bit;
+        invert_mask_[i/32] &= ~bit;
+        detached_mask_[i/32] &= ~bit;
+        if (i == 0 or sourcecfg_[i].dx.d)
             return;
         switch (sourcecfg_[i].d0.sm) {
             case Detached:
+                detached_mask_[i/32] |= bit;
+                edge_mask_[i/32] |= bit;
+                break;
             case Edge0:
+                invert_mask_[i/32] |= bit;
+                [[fallthrough]];
             case Edge1:
-                setIp(i);
+                edge_mask_[i/32] |= bit;
                 break;
             case Level0:
+                invert_mask_[i/32] |= bit;
+                [[fallthrough]];
             case Level1:
-                if (domaincfg_.fields.dm == MSI and rectifiedInputValue(i))
-                    setIp(i);
+                level_mask_[i/32] |= bit;
                 break;
-            default: assert(false);
         }
     }
 
+    void undelegate(unsigned i)
+    {
+        assert(i > 0 && i < 1024);
+        if (sourcecfg_[i].dx.d) {
+            children_[sourcecfg_[i].d1.child_index]->undelegate(i);
+        }
+        storeRelaxed(sourcecfg_.mut(i).value, 0);
+        updateSourceMasks(i);
+        setSourceOwner(i, this);
+        target_.mut(i) = Target{};
+        updateMsiAddr(i);
+        clearIp(i);
+        clearIe(i);
+    }
+
+    // Sets the pending bits selected by mask in word w, as far as software
+    // is allowed to: always for edge-sensitive and detached sources, and for
+    // level-sensitive sources only in MSI mode with the rectified input high.
+    void trySetIpWord(unsigned w, uint32_t mask)
+    {
+        uint32_t settable = mask & edge_mask_[w];
+        if (domaincfg_.fields.dm == MSI)
+            settable |= mask & level_mask_[w] & rectifiedInputWord(w);
+        writeIpWord(w, setip_[w] | settable);
+    }
+
+    // Clears the pending bits selected by mask in word w; level-sensitive
+    // sources can only be cleared by software in MSI mode.
+    void tryClearIpWord(unsigned w, uint32_t mask)
+    {
+        uint32_t clearable = edge_mask_[w];
+        if (domaincfg_.fields.dm == MSI)
+            clearable |= level_mask_[w];
+        writeIpWord(w, setip_[w] & ~(mask & clearable));
+    }
+
+    void trySetIp(unsigned i)
+    {
+        if (i == 0 or i >= 1024)
+            return;
+        trySetIpWord(i/32, 1u << (i % 32));
+    }
+
     void tryClearIp(unsigned i)
     {
-        if (not sourceIsActive(i))
+        if (i == 0 or i >= 1024)
             return;
-        switch (sourcecfg_[i].d0.sm) {
-            case Detached:
-            case Edge0:
-            case Edge1:
-                clearIp(i);
-                break;
-            case Level0:
-            case Level1:
-                if (domaincfg_.fields.dm == MSI)
-                    clearIp(i);
-                break;
-            default:
-                assert(false);
+        tryClearIpWord(i/32, 1u << (i % 32));
+    }
+
+    void writeIpWord(unsigned w, uint32_t value) { writeIeOrIpWord(false, w, value); }
+    void writeIeWord(unsigned w, uint32_t value) { writeIeOrIpWord(true, w, value); }
+
+    void writeIeOrIpWord(bool ie, unsigned w, uint32_t value)
+    {
+        auto& setix = ie ? setie_ : setip_;
+        uint32_t changed = setix[w] ^ value;
+        if (changed == 0)
+            return;
+        setix[w] = value;
+        if (not ie) {
+            count(&DomainStats::set_ips, std::popcount(changed & value));
+            count(&DomainStats::clear_ips, std::popcount(changed & ~value));
         }
+        if (setip_[w] & setie_[w])
+            ready_words_ |= 1u << w;
+        else
+            ready_words_ &= ~(1u << w);
+        // only sources both pending and enabled can move in or out of a heap
+        uint32_t affected = changed & (ie ? setip_[w] : setie_[w]);
+        for (; affected; affected &= affected - 1)
+            updateTopiSource(w*32 + std::countr_zero(affected));
+        markDirty();
     }
 
     void setOrClearIeOrIpBit(bool ie, unsigned i, bool set)
@@ -811,15 +1306,14 @@ private:
             return;
         if (set and not sourceIsActive(i))
             return;
-        auto& setix = ie ? setie_ : setip_;
+        const auto& setix = ie ? setie_ : setip_;
         uint32_t value = setix[i/32];
         uint32_t one_hot = 1 << (i % 32);
         if (set)
             value |= one_hot;
         else
             value &= ~one_hot;
-        setix[i/32] = value;
-        updateTopi();
+        writeIeOrIpWord(ie, i/32, value);
     }
 
     void setIp(unsigned i)   { setOrClearIeOrIpBit(false, i, true); }
@@ -837,29 +1331,58 @@ private:
     const bool be0_ok_;
     const bool be1_ok_;
 
-    const Aplic * aplic_;
+    Aplic * aplic_;
+    const std::atomic<uint32_t>* source_states_;   // the Aplic's raw input words
     std::string name_;
-    std::weak_ptr<Domain> parent_;
+    Domain* parent_;   // the Aplic owns every domain
+    Domain* root_;
+    unsigned child_index_;
     uint64_t base_;
     uint64_t size_;
     Privilege privilege_;
     std::vector<unsigned> hart_indices_;
+    unsigned hart_slot_base_ = 0;
+    std::vector<uint16_t> hart_slot_table_;
     std::vector<std::shared_ptr<Domain>> children_;
-    DirectDeliveryCallback direct_callback_ = nullptr;
-    MsiDeliveryCallback msi_callback_ = nullptr;
+    DeliverySink* sink_ = nullptr;
+    TraceRecorder* trace_ = nullptr;   // set by Aplic::startTrace
+    DomainStats stats_;
+    MsiBatch msi_batch_;   // reused by runCallbacksAsRequired
     std::vector<uint8_t> xeip_bits_;
+    std::vector<uint8_t> xeip_dirty_;
+    std::vector<unsigned> xeip_dirty_slots_;
+    bool xeip_all_dirty_ = false;
+    bool dirty_ = false;
+    std::atomic<bool> subtree_dirty_ = false;   // set by descendants without this domain's lock
+
+    // Thread-safe mode: mutex_ guards this domain's state. subtree_begin_
+    // and subtree_end_ give the range of this domain and its descendants in
+    // Aplic::lock_order_.
+    std::mutex mutex_;
+    size_t subtree_begin_ = 0;
+    size_t subtree_end_ = 0;
 
     Domaincfg domaincfg_;
-    std::array<Sourcecfg, 1024> sourcecfg_;
+    CowVector<Sourcecfg> sourcecfg_;       // indexed by source, numSources + 1 entries
     uint32_t     mmsiaddrcfg_;
     Mmsiaddrcfgh mmsiaddrcfgh_;
     uint32_t     smsiaddrcfg_;
     Smsiaddrcfgh smsiaddrcfgh_;
     std::array<uint32_t, 32> setip_;
     std::array<uint32_t, 32> setie_;
+    uint32_t ready_words_ = 0;              // bit w set if setip_[w] & setie_[w] is non-zero
+    std::array<uint32_t, 32> edge_mask_;
+    std::array<uint32_t, 32> level_mask_;
+    std::array<uint32_t, 32> invert_mask_;
+    std::array<uint32_t, 32> detached_mask_;
     Genmsi genmsi_;
-    std::array<Target, 1024> target_;
-    std::vector<Idc> idcs_;
+    CowVector<Target> target_;
+    CowVector<uint64_t> msi_addrs_;     // per source, MSI address of target_
+    std::vector<Idc> idcs_;                 // indexed by slot
+    std::vector<std::vector<uint32_t>> topi_heaps_;
+    // Updated by every heap operation, so copied by forks rather than shared.
+    std::vector<uint16_t> heap_pos_;        // indexed by source
+    std::vector<uint16_t> heap_slot_;
 };
 
 }
@@ -0,0 +1,175 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "Trace.hpp"
+#include <cstring>
+#include <stdexcept>
+
+using namespace TT_APLIC;
+
+static constexpr uint32_t trace_magic = 0x54504c41;   // "APLT"
+static constexpr uint32_t trace_version = 1;
+static constexpr uint32_t no_parent = ~0u;
+static constexpr size_t trace_buffer_size = 4096;
+
+namespace {
+
+class HeaderWriter
+{
+public:
+    void put32(uint32_t value) { put(&value, sizeof(value)); }
+    void put64(uint64_t value) { put(&value, sizeof(value)); }
+
+    void putString(const std::string& str)
+    {
+        put32(str.size());
+        put(str.data(), str.size());
+    }
+
+    void put(const void* data, size_t size)
+    {
+        auto bytes = static_cast<const uint8_t*>(data);
+        bytes_.insert(bytes_.end(), bytes, bytes + size);
+    }
+
+    std::vector<uint8_t> bytes_;
+};
+
+class HeaderReader
+{
+public:
+    explicit HeaderReader(std::span<const uint8_t> bytes) : bytes_(bytes) {}
+
+    uint32_t get32() { uint32_t value; get(&value, sizeof(value)); return value; }
+    uint64_t get64() { uint64_t value; get(&value, sizeof(value)); return value; }
+
+    std::string getString(uint32_t size)
+    {
+        std::string str(size, '\0');
+        get(str.data(), size);
+        return str;
+    }
+
+    void get(void* data, size_t size)
+    {
+        if (size > bytes_.size() - pos_)
+            throw std::runtime_error("trace header is truncated\n");
+        std::memcpy(data, bytes_.data() + pos_, size);
+        pos_ += size;
+    }
+
+    size_t pos() const { return pos_; }
+
+private:
+    std::span<const uint8_t> bytes_;
+    size_t pos_ = 0;
+};
+
+}
+
+std::vector<uint8_t> TraceHeader::encode() const
+{
+    HeaderWriter writer;
+    writer.put32(trace_magic);
+    writer.put32(trace_version);
+    writer.put32(num_harts);
+    writer.put32(num_sources);
+    writer.put32(thread_safe);
+    writer.put32(auto_forward_via_msi);
+    writer.put32(domains.size());
+    for (const auto& params : domains) {
+        writer.putString(params.name);
+        if (params.parent)
+            writer.putString(*params.parent);
+        else
+            writer.put32(no_parent);
+        writer.put32(params.child_index.value_or(0));
+        writer.put64(params.base);
+        writer.put64(params.size);
+        writer.put32(params.privilege);
+        writer.put32(params.hart_indices.size());
+        for (unsigned hart_index : params.hart_indices)
+            writer.put32(hart_index);
+        writer.put32(params.ipriolen);
+        writer.put32(params.eiidlen);
+        writer.put32(params.direct_mode_supported | params.msi_mode_supported << 1
+                     | params.le_supported << 2 | params.be_supported << 3);
+    }
+    writer.put32(state.size());
+    writer.put(state.data(), state.size());
+    writer.bytes_.resize((writer.bytes_.size() + 7) & ~size_t(7));
+    return writer.bytes_;
+}
+
+TraceHeader TraceHeader::decode(std::span<const uint8_t> trace, size_t& size)
+{
+    HeaderReader reader(trace);
+    if (reader.get32() != trace_magic or reader.get32() != trace_version)
+        throw std::runtime_error("not an APLIC trace\n");
+    TraceHeader header;
+    header.num_harts = reader.get32();
+    header.num_sources = reader.get32();
+    header.thread_safe = reader.get32();
+    header.auto_forward_via_msi = reader.get32();
+    unsigned num_domains = reader.get32();
+    for (unsigned d = 0; d < num_domains; d++) {
+        DomainParams params;
+        params.name = reader.getString(reader.get32());
+        uint32_t parent_size = reader.get32();
+        if (parent_size != no_parent)
+            params.parent = reader.getString(parent_size);
+        params.child_index = reader.get32();
+        params.base = reader.get64();
+        params.size = reader.get64();
+        params.privilege = reader.get32() == Machine ? Machine : Supervisor;
+        params.hart_indices.resize(reader.get32());
+        for (auto& hart_index : params.hart_indices)
+            hart_index = reader.get32();
+        params.ipriolen = reader.get32();
+        params.eiidlen = reader.get32();
+        uint32_t flags = reader.get32();
+        params.direct_mode_supported = flags & 1;
+        params.msi_mode_supported = flags & 2;
+        params.le_supported = flags & 4;
+        params.be_supported = flags & 8;
+        header.domains.push_back(std::move(params));
+    }
+    header.state.resize(reader.get32());
+    reader.get(header.state.data(), header.state.size());
+    size = (reader.pos() + 7) & ~size_t(7);
+    if (size > trace.size())
+        throw std::runtime_error("trace header is truncated\n");
+    return header;
+}
+
+TraceRecorder::TraceRecorder(const std::string& path, const TraceHeader& header)
+    : file_(std::fopen(path.c_str(), "wb")), start_(std::chrono::steady_clock::now())
+{
+    if (file_ == nullptr)
+        throw std::runtime_error("cannot create trace file '" + path + "'\n");
+    auto bytes = header.encode();
+    std::fwrite(bytes.data(), 1, bytes.size(), file_);
+    buffer_.reserve(trace_buffer_size);
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    flush();
+    std::fclose(file_);
+}
+
+void TraceRecorder::record(TraceOp op, uint64_t addr, uint32_t data, uint8_t flags)
+{
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    uint64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    std::lock_guard lock(mutex_);
+    buffer_.push_back({time, addr, data, op, flags, 0});
+    if (buffer_.size() == trace_buffer_size)
+        flush();
+}
+
+void TraceRecorder::flush()
+{
+    std::fwrite(buffer_.data(), sizeof(TraceRecord), buffer_.size(), file_);
+    buffer_.clear();
+}
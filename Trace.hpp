@@ -0,0 +1,92 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "Domain.hpp"
+
+namespace TT_APLIC {
+
+// The operations and deliveries recorded in a trace. The deliveries made by
+// an operation are recorded before the operation itself. The flags of an
+// operation include trace_auto_forward if autoForwardViaMsi was set.
+enum class TraceOp : uint8_t {
+    Read,               // addr, data read
+    Write,              // addr, data
+    SourceState,        // addr: source, data: state
+    SourceStateEntry,   // one change of a SourceStates group; addr: source, data: state
+    SourceStates,       // applies the entries recorded since the last operation
+    SourceStateWord,    // addr: word | mask << 32, data: states
+    ForwardViaMsi,      // addr: source, flags: trace_result if forwarded
+    BeginBatch,
+    Commit,
+    Reset,
+    DirectDelivery,     // addr: hart index, data: xeip, flags: privilege
+    MsiDelivery,        // addr, data
+    StateWord,          // one word of a RestoreState blob; data: the word
+    RestoreState,       // restores the blob of the StateWords recorded since the last operation
+};
+
+constexpr uint8_t trace_result = 1;
+constexpr uint8_t trace_auto_forward = 2;
+
+struct TraceRecord {
+    uint64_t time;      // nanoseconds since the trace was started
+    uint64_t addr;
+    uint32_t data;
+    TraceOp op;
+    uint8_t flags;
+    uint16_t reserved;
+};
+
+static_assert(sizeof(TraceRecord) == 24);
+
+// What is needed to recreate an Aplic as it was when a trace was started.
+// It is encoded at the start of the trace, padded to a multiple of 8 bytes,
+// and is followed by TraceRecords.
+struct TraceHeader {
+    unsigned num_harts = 0;
+    unsigned num_sources = 0;
+    bool thread_safe = false;
+    bool auto_forward_via_msi = true;
+    std::vector<DomainParams> domains;
+    std::vector<uint8_t> state;         // from Aplic::saveState
+
+    std::vector<uint8_t> encode() const;
+
+    // Decodes the header at the start of trace, setting size to the number
+    // of bytes it occupies. Throws std::runtime_error if it is malformed.
+    static TraceHeader decode(std::span<const uint8_t> trace, size_t& size);
+};
+
+// Writes a trace file. Records are buffered and written in the order
+// record is called, which may be from several threads.
+class TraceRecorder
+{
+public:
+    // Throws std::runtime_error if the file cannot be created.
+    TraceRecorder(const std::string& path, const TraceHeader& header);
+    ~TraceRecorder();
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+    void record(TraceOp op, uint64_t addr = 0, uint32_t data = 0, uint8_t flags = 0);
+
+private:
+    void flush();
+
+    std::FILE* file_;
+    std::mutex mutex_;
+    std::chrono::steady_clock::time_point start_;
+    std::vector<TraceRecord> buffer_;
+};
+
+}
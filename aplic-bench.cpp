@@ -0,0 +1,236 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+// Microbenchmarks for the register and delivery paths of the model. Each
+// benchmark repeats one kind of Aplic call and reports the time and heap
+// allocations per call, for a range of source, hart and domain counts.
+//
+// Usage: aplic-bench [<name-filter>]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <string>
+#include "Aplic.hpp"
+
+using namespace TT_APLIC;
+
+static size_t allocations = 0;
+
+void*
+operator new(size_t size)
+{
+  allocations++;
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void
+operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void
+operator delete(void* p, size_t) noexcept
+{
+  std::free(p);
+}
+
+struct Config {
+  unsigned sources;
+  unsigned harts;
+  unsigned domains;
+};
+
+static constexpr uint64_t base = 0x1000000;
+static constexpr uint64_t domain_size = 0x4000;
+
+// Register offsets within a domain's control region.
+static constexpr uint64_t sourcecfg = 0x0000;
+static constexpr uint64_t setip = 0x1c00;
+static constexpr uint64_t setipnum = 0x1cdc;
+static constexpr uint64_t in_clrip = 0x1d00;
+static constexpr uint64_t clripnum = 0x1ddc;
+static constexpr uint64_t setienum = 0x1edc;
+static constexpr uint64_t target = 0x3000;
+static constexpr uint64_t idc = 0x4000;
+
+// A chain of machine-level domains, each the parent of the next. The last
+// one, the leaf, holds all of the harts and has every source delegated to
+// it, in the given source and delivery modes, enabled and targeting the
+// harts in turn.
+static std::string
+domainName(unsigned d)
+{
+  std::string name = "d";
+  name += std::to_string(d);
+  return name;
+}
+
+struct Bench {
+  Bench(const Config& config, SourceMode sm, DeliveryMode dm)
+    : config(config)
+  {
+    std::vector<DomainParams> params;
+    for (unsigned d = 0; d < config.domains; d++) {
+      std::optional<std::string> parent;
+      if (d > 0)
+        parent = domainName(d - 1);
+      std::vector<unsigned> harts;
+      if (d == config.domains - 1) {
+        harts.resize(config.harts);
+        std::iota(harts.begin(), harts.end(), 0);
+      }
+      params.push_back({domainName(d), parent, 0, base + d*domain_size, domain_size, Machine, harts});
+    }
+    aplic = std::make_unique<Aplic>(config.harts, config.sources, params);
+    aplic->setDirectCallback([this](unsigned, Privilege, bool) { deliveries++; return true; });
+    aplic->setMsiCallback([this](uint64_t, uint32_t) { deliveries++; return true; });
+
+    for (unsigned d = 0; d + 1 < config.domains; d++)
+      for (unsigned i = 1; i <= config.sources; i++)
+        aplic->write(base + d*domain_size + sourcecfg + 4*i, 4, 0x400);
+    leaf = base + (config.domains - 1)*domain_size;
+    Domaincfg domaincfg{};
+    domaincfg.fields.ie = 1;
+    domaincfg.fields.dm = dm;
+    aplic->write(leaf, 4, domaincfg.value);
+    for (unsigned i = 1; i <= config.sources; i++) {
+      aplic->write(leaf + sourcecfg + 4*i, 4, sm);
+      Target tgt{};
+      if (dm == Direct) {
+        tgt.dm0.hart_index = i % config.harts;
+        tgt.dm0.iprio = 1 + i % 255;
+      } else {
+        tgt.dm1.hart_index = i % config.harts;
+        tgt.dm1.eiid = i;
+      }
+      aplic->write(leaf + target + 4*i, 4, tgt.value);
+      aplic->write(leaf + setienum, 4, i);
+    }
+    for (unsigned h = 0; h < config.harts; h++)
+      aplic->write(leaf + idc + 32*h, 4, 1);
+  }
+
+  // Source k of a round-robin over all of the sources.
+  unsigned source(size_t k) const { return 1 + k % config.sources; }
+
+  Config config;
+  std::unique_ptr<Aplic> aplic;
+  uint64_t leaf;
+  size_t deliveries = 0;
+};
+
+// Runs op(k) for k = 0, 1, ... until enough time has passed to measure, and
+// prints the time and allocations per call.
+template <typename Op>
+static void
+measure(const std::string& name, const Config& config, Op op)
+{
+  using clock = std::chrono::steady_clock;
+  size_t n = 64;
+  for (size_t k = 0; k < n; k++)
+    op(k);
+  while (true) {
+    size_t allocations_before = allocations;
+    auto start = clock::now();
+    for (size_t k = 0; k < n; k++)
+      op(k);
+    std::chrono::duration<double, std::nano> elapsed = clock::now() - start;
+    if (elapsed.count() > 2e7 or n >= (size_t(1) << 30)) {
+      std::printf("%-12s %8u %8u %8u %10.1f %12.3f\n", name.c_str(), config.sources, config.harts,
+                  config.domains, elapsed.count() / n, double(allocations - allocations_before) / n);
+      return;
+    }
+    n *= 2;
+  }
+}
+
+static void
+runBenchmarks(const Config& config, const std::string& filter)
+{
+  auto selected = [&filter](const std::string& name) { return name.find(filter) != std::string::npos; };
+
+  if (selected("read")) {
+    Bench b(config, Edge1, Direct);
+    measure("read", config, [&b](size_t k) {
+      uint32_t data;
+      b.aplic->read(b.leaf + sourcecfg + 4*b.source(k), 4, data);
+    });
+  }
+  if (selected("write")) {
+    Bench b(config, Edge1, Direct);
+    measure("write", config, [&b](size_t k) {
+      unsigned i = b.source(k);
+      b.aplic->write(b.leaf + target + 4*i, 4, (i % b.config.harts) << 18 | (1 + k % 255));
+    });
+  }
+  if (selected("edge-storm")) {
+    // rising edge, falling edge, clripnum
+    Bench b(config, Edge1, Direct);
+    measure("edge-storm", config, [&b](size_t k) {
+      unsigned i = b.source(k/3);
+      if (k % 3 == 2)
+        b.aplic->write(b.leaf + clripnum, 4, i);
+      else
+        b.aplic->setSourceState(i, k % 3 == 0);
+    });
+  }
+  if (selected("level-storm")) {
+    Bench b(config, Level1, Direct);
+    measure("level-storm", config, [&b](size_t k) {
+      b.aplic->setSourceState(b.source(k/2), k % 2 == 0);
+    });
+  }
+  if (selected("setip-bulk")) {
+    // all sources of a word pending, then none
+    Bench b(config, Edge1, Direct);
+    unsigned words = b.config.sources/32 + 1;
+    measure("setip-bulk", config, [&b, words](size_t k) {
+      unsigned w = (k/2) % words;
+      b.aplic->write(b.leaf + (k % 2 == 0 ? setip : in_clrip) + 4*w, 4, ~0u);
+    });
+  }
+  if (selected("claimi")) {
+    // setipnum, then claimi of the target hart
+    Bench b(config, Edge1, Direct);
+    measure("claimi", config, [&b](size_t k) {
+      unsigned i = b.source(k/2);
+      if (k % 2 == 0) {
+        b.aplic->write(b.leaf + setipnum, 4, i);
+      } else {
+        uint32_t data;
+        b.aplic->read(b.leaf + idc + 32*(i % b.config.harts) + 0x1c, 4, data);
+      }
+    });
+  }
+  if (selected("msi-storm")) {
+    // rising edges forward an MSI each
+    Bench b(config, Edge1, MSI);
+    measure("msi-storm", config, [&b](size_t k) {
+      b.aplic->setSourceState(b.source(k/2), k % 2 == 0);
+    });
+  }
+}
+
+int
+main(int argc, char** argv)
+{
+  std::string filter = argc > 1 ? argv[1] : "";
+  std::vector<Config> configs;
+  for (unsigned sources : {1, 32, 1023})
+    for (unsigned harts : {1, 64, 16384})
+      configs.push_back({sources, harts, 1});
+  for (unsigned domains : {4, 16})
+    configs.push_back({1023, 64, domains});
+
+  std::printf("%-12s %8s %8s %8s %10s %12s\n", "benchmark", "sources", "harts", "domains", "ns/op", "allocs/op");
+  for (const auto& config : configs)
+    runBenchmarks(config, filter);
+  return 0;
+}
@@ -0,0 +1,209 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+// Replays a trace written by Aplic::startTrace against the model as fast as
+// it can, checking that every operation makes the recorded deliveries and
+// reads the recorded values, and reports the rate achieved.
+//
+// Usage: aplic-replay <trace-file> [<repeat-count>]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Aplic.hpp"
+
+using namespace TT_APLIC;
+
+struct Delivery {
+  TraceOp op;
+  uint64_t addr;
+  uint32_t data;
+  uint8_t flags;
+
+  bool operator==(const Delivery&) const = default;
+};
+
+static std::ostream&
+operator<<(std::ostream& os, const Delivery& delivery)
+{
+  if (delivery.op == TraceOp::DirectDelivery)
+    return os << "direct hart=" << delivery.addr << " privilege="
+              << (delivery.flags == Machine ? "machine" : "supervisor")
+              << " xeip=" << delivery.data;
+  return os << "msi addr=0x" << std::hex << delivery.addr << " data=0x"
+            << delivery.data << std::dec;
+}
+
+// Replays records once. Returns false, after reporting the first mismatch,
+// if the model does not behave as recorded.
+static bool
+replay(Aplic& aplic, std::span<const TraceRecord> records, std::vector<Delivery>& made, size_t& num_ops)
+{
+  std::vector<std::pair<unsigned, bool>> group;
+  std::vector<uint32_t> state;
+  size_t first = 0;   // first record since the previous operation
+  num_ops = 0;
+  for (size_t k = 0; k < records.size(); k++) {
+    const auto& record = records[k];
+    bool ok = true;
+    if (record.op != TraceOp::DirectDelivery and record.op != TraceOp::MsiDelivery)
+      aplic.autoForwardViaMsi = record.flags & trace_auto_forward;
+    switch (record.op) {
+      case TraceOp::DirectDelivery:
+      case TraceOp::MsiDelivery:
+        continue;
+      case TraceOp::SourceStateEntry:
+        group.push_back({unsigned(record.addr), bool(record.data)});
+        continue;
+      case TraceOp::StateWord:
+        state.push_back(record.data);
+        continue;
+      case TraceOp::Read: {
+        uint32_t data = 0;
+        aplic.read(record.addr, 4, data);
+        if (data != record.data) {
+          std::cerr << "record " << k << ": read of 0x" << std::hex << record.addr << " returned 0x"
+                    << data << ", expected 0x" << record.data << std::dec << '\n';
+          return false;
+        }
+        break;
+      }
+      case TraceOp::Write:
+        aplic.write(record.addr, 4, record.data);
+        break;
+      case TraceOp::SourceState:
+        aplic.setSourceState(record.addr, record.data);
+        break;
+      case TraceOp::SourceStates:
+        aplic.setSourceStates(group);
+        group.clear();
+        break;
+      case TraceOp::SourceStateWord:
+        aplic.setSourceStates(record.addr & 0xffffffff, record.addr >> 32, record.data);
+        break;
+      case TraceOp::ForwardViaMsi:
+        ok = aplic.forwardViaMsi(record.addr) == bool(record.flags & trace_result);
+        break;
+      case TraceOp::BeginBatch:
+        aplic.beginBatch();
+        break;
+      case TraceOp::Commit:
+        aplic.commit();
+        break;
+      case TraceOp::Reset:
+        aplic.reset();
+        break;
+      case TraceOp::RestoreState:
+        aplic.restoreState({reinterpret_cast<const uint8_t*>(state.data()), state.size()*sizeof(uint32_t)});
+        state.clear();
+        break;
+      default:
+        std::cerr << "record " << k << ": unknown operation " << unsigned(record.op) << '\n';
+        return false;
+    }
+    if (not ok) {
+      std::cerr << "record " << k << ": forwardViaMsi(" << record.addr << ") did not return "
+                << (record.flags & trace_result ? "true" : "false") << '\n';
+      return false;
+    }
+
+    // The deliveries recorded since the previous operation are this one's.
+    size_t n = 0;
+    for (size_t j = first; j < k; j++) {
+      const auto& expected = records[j];
+      if (expected.op != TraceOp::DirectDelivery and expected.op != TraceOp::MsiDelivery)
+        continue;
+      Delivery delivery{expected.op, expected.addr, expected.data, expected.flags};
+      if (n >= made.size() or made[n] != delivery) {
+        std::cerr << "record " << k << ": expected delivery " << delivery;
+        if (n < made.size())
+          std::cerr << ", model made " << made[n];
+        std::cerr << '\n';
+        return false;
+      }
+      n++;
+    }
+    if (n != made.size()) {
+      std::cerr << "record " << k << ": unexpected delivery " << made[n] << '\n';
+      return false;
+    }
+    made.clear();
+    first = k + 1;
+    num_ops++;
+  }
+  return true;
+}
+
+int
+main(int argc, char** argv)
+{
+  if (argc < 2 or argc > 3) {
+    std::cerr << "usage: " << argv[0] << " <trace-file> [<repeat-count>]\n";
+    return 2;
+  }
+  unsigned repeat = argc > 2 ? std::max(1, std::atoi(argv[2])) : 1;
+
+  int fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd < 0 or fstat(fd, &st) != 0) {
+    std::cerr << "cannot open " << argv[1] << '\n';
+    return 2;
+  }
+  size_t file_size = st.st_size;
+  void* map = file_size ? mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED) {
+    std::cerr << "cannot map " << argv[1] << '\n';
+    return 2;
+  }
+  std::span<const uint8_t> bytes(static_cast<const uint8_t*>(map), file_size);
+
+  int status = 0;
+  try {
+    size_t header_size = 0;
+    TraceHeader header = TraceHeader::decode(bytes, header_size);
+    std::span<const TraceRecord> records(reinterpret_cast<const TraceRecord*>(bytes.data() + header_size),
+                                         (file_size - header_size) / sizeof(TraceRecord));
+
+    Aplic aplic(header.num_harts, header.num_sources, header.domains, header.thread_safe);
+    std::vector<Delivery> made;
+    made.reserve(1024);
+    aplic.setDirectCallback([&made](unsigned hart_index, Privilege privilege, bool xeip) {
+      made.push_back({TraceOp::DirectDelivery, hart_index, xeip, uint8_t(privilege)});
+      return true;
+    });
+    aplic.setMsiCallback([&made](uint64_t addr, uint32_t data) {
+      made.push_back({TraceOp::MsiDelivery, addr, data, 0});
+      return true;
+    });
+
+    size_t num_ops = 0;
+    double best = 0;
+    for (unsigned r = 0; r < repeat and status == 0; r++) {
+      aplic.autoForwardViaMsi = header.auto_forward_via_msi;
+      aplic.restoreState(header.state);
+      made.clear();
+      auto start = std::chrono::steady_clock::now();
+      if (not replay(aplic, records, made, num_ops))
+        status = 1;
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      if (best == 0 or elapsed.count() < best)
+        best = elapsed.count();
+    }
+    if (status == 0) {
+      std::cout << "replayed " << num_ops << " operations (" << records.size() << " records)";
+      if (repeat > 1)
+        std::cout << ", best of " << repeat;
+      std::cout << ": " << best << " s, " << (best > 0 ? num_ops / best : 0) << " ops/sec\n";
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what();
+    status = 2;
+  }
+  munmap(map, file_size);
+  return status;
+}
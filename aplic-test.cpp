@@ -1,7 +1,11 @@
 // SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
 // SPDX-License-Identifier: Apache-2.0
 
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <thread>
 #include "Aplic.hpp"
 
 using namespace TT_APLIC;
@@ -1384,6 +1388,1660 @@ void test_17_pending_extended()
 }
 
 
+void test_18_topi_tiebreak()
+{
+  unsigned hartCount = 2, interruptCount = 40;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root", std::nullopt, 0, addr, domainSize, Machine, {0, 1} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+
+  auto root = aplic.root();
+
+  Domaincfg dcfg{};
+  dcfg.fields.dm = 0;
+  dcfg.fields.ie = 1;
+  root->writeDomaincfg(dcfg.value);
+
+  Sourcecfg sourcecfg{};
+  sourcecfg.d0.sm = Edge1;
+  unsigned sources[] = { 33, 4, 17, 9, 38 };
+  unsigned prios[] = { 2, 5, 2, 7, 2 };
+  for (unsigned k = 0; k < 5; k++) {
+    root->writeSourcecfg(sources[k], sourcecfg.value);
+    Target tgt{};
+    tgt.dm0.hart_index = 0;
+    tgt.dm0.iprio = prios[k];
+    root->writeTarget(sources[k], tgt.value);
+    root->writeSetienum(sources[k]);
+    root->writeSetipnum(sources[k]);
+  }
+
+  // Equal priorities resolve to the lowest interrupt identity.
+  uint32_t topi = root->readTopi(0);
+  assert((topi >> 16) == 17 and (topi & 0xff) == 2);
+  assert(root->readTopi(1) == 0);
+
+  // Retargeting the top interrupt to another hart exposes the next one.
+  Target tgt{};
+  tgt.dm0.hart_index = 1;
+  tgt.dm0.iprio = 2;
+  root->writeTarget(17, tgt.value);
+  assert((root->readTopi(0) >> 16) == 33);
+  assert((root->readTopi(1) >> 16) == 17);
+
+  // Claims drain hart 0 in (priority, identity) order.
+  unsigned expected[] = { 33, 38, 4, 9 };
+  for (unsigned iid : expected) {
+    uint32_t claimi = root->readClaimi(0);
+    assert((claimi >> 16) == iid);
+  }
+  assert(root->readClaimi(0) == 0);
+
+  // A threshold at or below the top priority masks topi without losing it.
+  root->writeSetipnum(9);
+  root->writeSetipnum(4);
+  root->writeIthreshold(0, 5);
+  assert(root->readTopi(0) == 0);
+  root->writeIthreshold(0, 6);
+  assert((root->readTopi(0) >> 16) == 4);
+  root->writeClrienum(4);
+  assert(root->readTopi(0) == 0);
+  root->writeIthreshold(0, 0);
+  assert((root->readTopi(0) >> 16) == 9);
+
+  std::cerr << "Test test_18_topi_tiebreak passed.\n";
+}
+
+
+void test_19_dirty_harts()
+{
+  unsigned hartCount = 4, interruptCount = 8;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root", std::nullopt, 0, addr, domainSize, Machine, {3, 1, 0, 2} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  std::vector<InterruptRecord> records;
+  aplic.setDirectCallback([&records](unsigned hart, Privilege privilege, bool state) {
+    records.push_back({hart, privilege, state});
+    return true;
+  });
+  auto root = aplic.root();
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  root->writeDomaincfg(dcfg.value);
+  Sourcecfg edge1{};
+  edge1.d0.sm = Edge1;
+  // odd sources target hart 0, even ones hart 3; harts 1 and 2 get none
+  for (unsigned i = 1; i <= interruptCount; i++) {
+    root->writeSourcecfg(i, edge1.value);
+    Target tgt{};
+    tgt.dm0.hart_index = i % 2 ? 0 : 3;
+    tgt.dm0.iprio = i;
+    root->writeTarget(i, tgt.value);
+    root->writeSetienum(i);
+  }
+  for (unsigned hart = 0; hart < hartCount; hart++)
+    root->writeIdelivery(hart, 1);
+  assert(records.empty());
+
+  // One callback per affected hart, in hart_indices order.
+  root->writeSetip(0, 0x1fe);
+  assert(records.size() == 2);
+  assert(records[0].hartIx == 3 and records[0].state);
+  assert(records[1].hartIx == 0 and records[1].state);
+
+  // Hart 0 keeps source 1 pending, so only hart 3 changes.
+  records.clear();
+  root->writeInClrip(0, 0x1fc);
+  assert(records.size() == 1 and records[0].hartIx == 3 and not records[0].state);
+
+  // Nothing changes for a hart whose topi stays non-zero.
+  records.clear();
+  root->writeSetip(0, 0x4);
+  assert(records.size() == 1 and records[0].hartIx == 3);
+  records.clear();
+  root->writeSetip(0, 0x2a);
+  assert(records.empty());
+  assert(root->readTopi(0) == ((1 << 16) | 1) and root->readTopi(3) == ((2 << 16) | 2));
+
+  std::cerr << "Test test_19_dirty_harts passed.\n";
+}
+
+
+void test_20_dirty_domains()
+{
+  unsigned hartCount = 2, interruptCount = 8;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root", std::nullopt, 0, addr,                domainSize, Machine,    {1} },
+      { "a",    "root",       0, addr + domainSize,   domainSize, Machine,    {0} },
+      { "a0",   "a",          0, addr + 2*domainSize, domainSize, Supervisor, {0} },
+      { "b",    "root",       1, addr + 3*domainSize, domainSize, Supervisor, {1} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  std::vector<InterruptRecord> records;
+  std::vector<std::pair<uint64_t, uint32_t>> msis;
+  aplic.setDirectCallback([&records](unsigned hart, Privilege privilege, bool state) {
+    records.push_back({hart, privilege, state});
+    return true;
+  });
+  aplic.setMsiCallback([&msis](uint64_t msi_addr, uint32_t data) {
+    msis.push_back({msi_addr, data});
+    return true;
+  });
+
+  // Source 1 is delegated to a, source 2 to b, source 3 stays in root.
+  auto root = aplic.root();
+  auto a = root->child(0);
+  auto b = root->child(1);
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  root->writeDomaincfg(dcfg.value);
+  a->writeDomaincfg(dcfg.value);
+  root->child(0)->child(0)->writeDomaincfg(dcfg.value);
+  dcfg.fields.dm = MSI;
+  b->writeDomaincfg(dcfg.value);
+  Sourcecfg edge1{};
+  edge1.d0.sm = Edge1;
+  Sourcecfg to_a{}, to_b{};
+  to_a.d1.d = 1;
+  to_b.d1.d = 1;
+  to_b.d1.child_index = 1;
+  root->writeSourcecfg(1, to_a.value);
+  root->writeSourcecfg(2, to_b.value);
+  root->writeSourcecfg(3, edge1.value);
+  a->writeSourcecfg(1, edge1.value);
+  b->writeSourcecfg(2, edge1.value);
+  Target tgt{};
+  tgt.dm0.hart_index = 1;
+  tgt.dm0.iprio = 1;
+  root->writeTarget(3, tgt.value);
+  tgt.dm0.hart_index = 0;
+  a->writeTarget(1, tgt.value);
+  Target msi_tgt{};
+  msi_tgt.dm1.eiid = 7;
+  b->writeTarget(2, msi_tgt.value);
+  root->writeSetienum(3);
+  a->writeSetienum(1);
+  b->writeSetienum(2);
+  root->writeIdelivery(1, 1);
+  a->writeIdelivery(0, 1);
+  assert(records.empty() and msis.empty());
+  aplic.resetStats();
+
+  // A root register write is evaluated in root only.
+  aplic.write(addr + 0x1cdc, 4, 3);   // setipnum
+  assert(records.size() == 1 and records[0].hartIx == 1 and records[0].privilege == Machine);
+  if (stats_enabled) {
+    auto stats = aplic.stats();
+    assert(stats[0].second.delivery_passes == 1);
+    for (unsigned d = 1; d < stats.size(); d++)
+      assert(stats[d].second.delivery_passes == 0);
+  }
+
+  // An edge of a's source is evaluated in a only, not in its child or b.
+  records.clear();
+  aplic.resetStats();
+  aplic.setSourceState(1, true);
+  assert(records.size() == 1 and records[0].hartIx == 0 and records[0].privilege == Machine);
+  assert(msis.empty());
+  if (stats_enabled) {
+    auto stats = aplic.stats();
+    assert(stats[0].first == "root" and stats[0].second.delivery_passes == 0);
+    assert(stats[1].first == "a" and stats[1].second.delivery_passes == 1);
+    assert(stats[2].first == "a0" and stats[2].second.delivery_passes == 0);
+    assert(stats[3].first == "b" and stats[3].second.delivery_passes == 0);
+  }
+
+  // Without auto-forwarding b keeps its ready source, and stays dirty, so
+  // the first pass after re-enabling it forwards the MSI, even one started
+  // by an unrelated root write.
+  records.clear();
+  aplic.autoForwardViaMsi = false;
+  aplic.setSourceState(2, true);
+  assert(msis.empty() and b->readSetip(0) == 0x4);
+  aplic.write(addr + 0x1ddc, 4, 3);   // clripnum
+  assert(msis.empty() and b->readSetip(0) == 0x4);
+  aplic.autoForwardViaMsi = true;
+  aplic.write(addr + 0x1cdc, 4, 3);   // setipnum
+  assert(msis.size() == 1 and msis[0].second == 7);
+  assert(b->readSetip(0) == 0);
+  assert(records.size() == 2);
+
+  // Once forwarded b is clean again.
+  msis.clear();
+  aplic.resetStats();
+  aplic.write(addr + 0x1ddc, 4, 3);   // clripnum
+  assert(msis.empty());
+  if (stats_enabled)
+    assert(aplic.stats()[3].second.delivery_passes == 0);
+
+  std::cerr << "Test test_20_dirty_domains passed.\n";
+}
+
+
+void test_21_masked_words()
+{
+  unsigned hartCount = 1, interruptCount = 8;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root", std::nullopt, 0, addr, domainSize, Machine, {0} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  aplic.autoForwardViaMsi = false;
+  auto root = aplic.root();
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  root->writeDomaincfg(dcfg.value);
+
+  // Sources 1-6: Edge1, Edge0, Level1, Level0, Detached, Inactive. All
+  // inputs are low, so the inverted sources 2 and 4 become pending.
+  SourceMode modes[] = { Edge1, Edge0, Level1, Level0, Detached, Inactive };
+  for (unsigned i = 1; i <= 6; i++) {
+    Sourcecfg cfg{};
+    cfg.d0.sm = modes[i - 1];
+    root->writeSourcecfg(i, cfg.value);
+  }
+  assert(root->readSetip(0) == 0x14);
+  assert(root->readInClrip(0) == 0x14);
+
+  // In direct mode only edge-sensitive and detached sources can be set or
+  // cleared by software.
+  root->writeInClrip(0, 0x7e);
+  assert(root->readSetip(0) == 0x10);
+  root->writeSetip(0, 0x7e);
+  assert(root->readSetip(0) == 0x36);
+
+  // Level sources follow their rectified inputs.
+  aplic.setSourceState(4, true);
+  aplic.setSourceState(3, true);
+  assert(root->readSetip(0) == 0x2e);
+  assert(root->readInClrip(0) == 0x0c);
+
+  // Only active sources can be enabled.
+  root->writeSetie(0, 0x7e);
+  assert(root->readSetie(0) == 0x3e);
+  root->writeClrie(0, 0x0a);
+  assert(root->readSetie(0) == 0x34);
+
+  // In MSI mode level sources can be cleared, and set while their
+  // rectified input is high.
+  dcfg.fields.dm = MSI;
+  root->writeDomaincfg(dcfg.value);
+  root->writeInClrip(0, 0x7e);
+  assert(root->readSetip(0) == 0);
+  root->writeSetip(0, 0x7e);
+  assert(root->readSetip(0) == 0x2e);
+  aplic.setSourceState(4, false);
+  assert(root->readSetip(0) == 0x3e);
+
+  std::cerr << "Test test_21_masked_words passed.\n";
+}
+
+
+void test_22_in_clrip_rectified()
+{
+  unsigned hartCount = 1, interruptCount = 40;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root",   std::nullopt, 0, addr,                domainSize, Machine,    {0} },
+      { "child",  "root",       0, addr + domainSize,   domainSize, Supervisor, {0} },
+      { "child2", "root",       1, addr + 2*domainSize, domainSize, Supervisor, {} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+
+  auto root = aplic.root();
+  auto child = root->child(0);
+  auto child2 = root->child(1);
+
+  // Sources 1-5 in root: Detached, Edge1, Edge0, Level1, Level0; source 34
+  // is Level0 in the second word.
+  unsigned modes[] = { Detached, Edge1, Edge0, Level1, Level0 };
+  for (unsigned k = 0; k < 5; k++) {
+    Sourcecfg cfg{};
+    cfg.d0.sm = modes[k];
+    root->writeSourcecfg(k + 1, cfg.value);
+  }
+  Sourcecfg level0{};
+  level0.d0.sm = Level0;
+  root->writeSourcecfg(34, level0.value);
+
+  // All inputs low: only the inverted modes read as 1.
+  assert(root->readInClrip(0) == ((1 << 3) | (1 << 5)));
+  assert(root->readInClrip(1) == (1 << 2));
+
+  for (unsigned i = 1; i <= 5; i++)
+    aplic.setSourceState(i, true);
+  aplic.setSourceState(34, true);
+  assert(root->readInClrip(0) == ((1 << 2) | (1 << 4)));
+  assert(root->readInClrip(1) == 0);
+
+  // A delegated source reads 0 in the parent and its rectified value in
+  // the child it was delegated to.
+  Sourcecfg delegate{};
+  delegate.d1.d = true;
+  delegate.d1.child_index = 0;
+  root->writeSourcecfg(2, delegate.value);
+  assert((root->readInClrip(0) & (1 << 2)) == 0);
+  assert(child->readInClrip(0) == 0);
+  Sourcecfg edge1{};
+  edge1.d0.sm = Edge1;
+  child->writeSourcecfg(2, edge1.value);
+  assert(child->readInClrip(0) == (1 << 2));
+  aplic.setSourceState(2, false);
+  assert(child->readInClrip(0) == 0);
+
+  // A sibling the source was not delegated to cannot configure it.
+  child2->writeSourcecfg(2, edge1.value);
+  assert(child2->readSourcecfg(2) == 0);
+  assert(child2->readInClrip(0) == 0);
+
+  // Taking the source back makes the parent read the current input again.
+  root->writeSourcecfg(2, edge1.value);
+  assert(child->readSourcecfg(2) == 0);
+  assert((root->readInClrip(0) & (1 << 2)) == 0);
+  aplic.setSourceState(2, true);
+  assert(root->readInClrip(0) & (1 << 2));
+
+  std::cerr << "Test test_22_in_clrip_rectified passed.\n";
+}
+
+
+void test_23_address_decode()
+{
+  unsigned hartCount = 2, interruptCount = 8;
+  uint64_t domainSize = 16 * 1024;
+  // Listed out of address order, with a gap between the two children.
+  DomainParams domain_params[] = {
+      { "child2", "root",       1, 0x3000000, 2*domainSize, Machine,    {1} },
+      { "root",   std::nullopt, 0, 0x2000000, domainSize,   Machine,    {0} },
+      { "child",  "root",       0, 0x1000000, domainSize,   Supervisor, {0} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+
+  assert(not aplic.containsAddr(0xfff000));
+  assert(aplic.findDomainByAddr(0x1000000)->name() == "child");
+  assert(aplic.findDomainByAddr(0x1000000 + domainSize - 4)->name() == "child");
+  assert(not aplic.containsAddr(0x1000000 + domainSize));
+  assert(aplic.findDomainByAddr(0x2000000)->name() == "root");
+  assert(not aplic.containsAddr(0x2000000 + domainSize));
+  assert(aplic.findDomainByAddr(0x3000000 + 2*domainSize - 4)->name() == "child2");
+  assert(not aplic.containsAddr(0x3000000 + 2*domainSize));
+
+  uint32_t data = 0;
+  assert(not aplic.read(0x2800000, 4, data));
+  assert(not aplic.write(0x2800000, 4, 0));
+  assert(aplic.write(0x3000000, 4, 0x100));
+  assert(aplic.read(0x3000000, 4, data));
+  assert(data == 0x80000100);
+  assert(aplic.findDomainByName("child2")->readDomaincfg() == 0x80000100);
+
+  std::cerr << "Test test_23_address_decode passed.\n";
+}
+
+
+void test_24_batched_source_states()
+{
+  unsigned hartCount = 2, interruptCount = 40;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root",  std::nullopt, 0, addr,              domainSize, Machine,    {0, 1} },
+      { "child", "root",       0, addr + domainSize, domainSize, Supervisor, {0, 1} },
+  };
+
+  auto configure = [&](Aplic& aplic) {
+    auto root = aplic.root();
+    auto child = root->child(0);
+    Domaincfg dcfg{};
+    dcfg.fields.ie = 1;
+    root->writeDomaincfg(dcfg.value);
+    child->writeDomaincfg(dcfg.value);
+    Sourcecfg level1{};
+    level1.d0.sm = Level1;
+    Sourcecfg delegate{};
+    delegate.d1.d = true;
+    for (unsigned i = 1; i <= interruptCount; i++) {
+      auto domain = i % 2 ? root : child;
+      if (domain == child)
+        root->writeSourcecfg(i, delegate.value);
+      domain->writeSourcecfg(i, level1.value);
+      Target tgt{};
+      tgt.dm0.hart_index = i % 3 == 0;
+      tgt.dm0.iprio = 1 + i % 4;
+      domain->writeTarget(i, tgt.value);
+      domain->writeSetienum(i);
+    }
+    for (unsigned hart = 0; hart < hartCount; hart++) {
+      root->writeIdelivery(hart, 1);
+      child->writeIdelivery(hart, 1);
+    }
+  };
+
+  std::vector<InterruptRecord> sequential, batched;
+  auto record = [](std::vector<InterruptRecord>& log) {
+    return [&log](unsigned hart, Privilege privilege, bool state) {
+      log.push_back({hart, privilege, state});
+      return true;
+    };
+  };
+
+  Aplic seq(hartCount, interruptCount, domain_params);
+  Aplic bat(hartCount, interruptCount, domain_params);
+  configure(seq);
+  configure(bat);
+  seq.setDirectCallback(record(sequential));
+  bat.setDirectCallback(record(batched));
+
+  // Raise every line, then drop source 3 again within the same group.
+  std::vector<std::pair<unsigned, bool>> changes;
+  for (unsigned i = 1; i <= interruptCount; i++)
+    changes.push_back({i, true});
+  changes.push_back({3, false});
+  for (auto [i, state] : changes)
+    seq.setSourceState(i, state);
+  bat.setSourceStates(changes);
+
+  // Same final state; one delivery per hart and domain in the batch.
+  for (unsigned w = 0; w < 2; w++) {
+    assert(seq.root()->readSetip(w) == bat.root()->readSetip(w));
+    assert(seq.root()->child(0)->readSetip(w) == bat.root()->child(0)->readSetip(w));
+  }
+  for (unsigned hart = 0; hart < hartCount; hart++) {
+    assert(seq.root()->readTopi(hart) == bat.root()->readTopi(hart));
+    assert(seq.root()->child(0)->readTopi(hart) == bat.root()->child(0)->readTopi(hart));
+  }
+  assert(batched.size() == 4);
+  for (auto& rec : batched)
+    assert(rec.state);
+
+  // The word form lowers sources 1-31 in one call.
+  batched.clear();
+  bat.setSourceStates(0, 0xffffffff, 0);
+  assert(bat.root()->readSetip(0) == 0);
+  assert(bat.root()->child(0)->readSetip(0) == 0);
+  assert(bat.root()->readSetip(1) != 0);
+  assert(batched.empty());
+
+  // Strict mode matches sequential calls callback for callback.
+  seq.setSourceStates(0, 0xffffffff, 0);
+  sequential.clear();
+  batched.clear();
+  std::vector<std::pair<unsigned, bool>> toggles;
+  for (unsigned i = 32; i <= interruptCount; i++)
+    toggles.push_back({i, false});
+  toggles.push_back({33, true});
+  for (auto [i, state] : toggles)
+    seq.setSourceState(i, state);
+  bat.setSourceStates(toggles, true);
+  assert(not sequential.empty());
+  assert(sequential.size() == batched.size());
+  for (size_t k = 0; k < sequential.size(); k++) {
+    assert(sequential[k].hartIx == batched[k].hartIx);
+    assert(sequential[k].privilege == batched[k].privilege);
+    assert(sequential[k].state == batched[k].state);
+  }
+
+  // A group with an invalid source is rejected before any change is made.
+  for (unsigned bad : {0u, interruptCount + 1}) {
+    for (bool strict : {false, true}) {
+      batched.clear();
+      std::vector<std::pair<unsigned, bool>> group = {{1, true}, {bad, true}, {2, true}};
+      bool threw = false;
+      try {
+        bat.setSourceStates(group, strict);
+      } catch (const std::out_of_range&) {
+        threw = true;
+      }
+      assert(threw);
+      assert(not bat.getSourceState(1) and not bat.getSourceState(2));
+      assert(bat.root()->readSetip(0) == 0 and bat.root()->child(0)->readSetip(0) == 0);
+      assert(batched.empty());
+    }
+  }
+
+  std::cerr << "Test test_24_batched_source_states passed.\n";
+}
+
+
+void test_25_deferred_commit()
+{
+  unsigned hartCount = 1, interruptCount = 8;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root",  std::nullopt, 0, addr,              domainSize, Machine,    {0} },
+      { "child", "root",       0, addr + domainSize, domainSize, Supervisor, {0} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  auto root = aplic.root();
+  auto child = root->child(0);
+
+  std::vector<InterruptRecord> direct;
+  aplic.setDirectCallback([&direct](unsigned hart, Privilege privilege, bool state) {
+    direct.push_back({hart, privilege, state});
+    return true;
+  });
+  std::vector<std::pair<uint64_t, uint32_t>> msis;
+  aplic.setMsiCallback([&msis](uint64_t addr, uint32_t data) {
+    msis.push_back({addr, data});
+    return true;
+  });
+
+  // Direct delivery in root; sources 1 and 2 edge-triggered.
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  root->writeDomaincfg(dcfg.value);
+  Sourcecfg edge1{};
+  edge1.d0.sm = Edge1;
+  root->writeSourcecfg(1, edge1.value);
+  root->writeSourcecfg(2, edge1.value);
+  root->writeSetie(0, 0b110);
+  root->writeIdelivery(0, 1);
+  assert(direct.empty());
+
+  // On and off again within a batch: no callback at all.
+  aplic.beginBatch();
+  aplic.setSourceState(1, true);
+  assert(root->readTopi(0) >> 16 == 1);
+  root->writeClripnum(1);
+  aplic.commit();
+  assert(direct.empty());
+
+  // Several changes that end with xeip set produce a single callback.
+  aplic.beginBatch();
+  aplic.setSourceState(1, false);
+  aplic.setSourceState(1, true);
+  root->writeSetipnum(2);
+  aplic.beginBatch();
+  root->writeClripnum(1);
+  aplic.commit();
+  assert(aplic.inBatch());
+  assert(direct.empty());
+  aplic.commit();
+  assert(not aplic.inBatch());
+  assert(direct.size() == 1 and direct[0].state);
+
+  // MSI forwarding is deferred to the commit and done in source order.
+  Sourcecfg delegate{};
+  delegate.d1.d = true;
+  for (unsigned i = 3; i <= 5; i++) {
+    root->writeSourcecfg(i, delegate.value);
+    child->writeSourcecfg(i, edge1.value);
+    Target tgt{};
+    tgt.dm1.eiid = 10 + i;
+    child->writeTarget(i, tgt.value);
+  }
+  dcfg.fields.dm = MSI;
+  child->writeDomaincfg(dcfg.value);
+  child->writeSetie(0, 0b111000);
+  aplic.beginBatch();
+  aplic.setSourceState(5, true);
+  aplic.setSourceState(3, true);
+  aplic.setSourceState(4, true);
+  assert(msis.empty());
+  assert(child->readSetip(0) == 0b111000);
+  aplic.commit();
+  assert(msis.size() == 3);
+  assert(msis[0].second == 13 and msis[1].second == 14 and msis[2].second == 15);
+  assert(child->readSetip(0) == 0);
+
+  std::cerr << "Test test_25_deferred_commit passed.\n";
+}
+
+
+void test_26_source_count_bound()
+{
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root", std::nullopt, 0, addr, domainSize, Machine, {0, 1, 2, 3, 4, 5, 6, 7} },
+  };
+  Aplic aplic(8, 64, domain_params);
+  assert(aplic.numSources() == 64 and aplic.numHarts() == 8);
+
+  auto root = aplic.root();
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  root->writeDomaincfg(dcfg.value);
+  Sourcecfg level1{};
+  level1.d0.sm = Level1;
+  root->writeSourcecfg(64, level1.value);
+  root->writeSourcecfg(65, level1.value);
+  assert(root->readSourcecfg(64) == level1.value);
+  assert(root->readSourcecfg(65) == 0);
+
+  Target tgt{};
+  tgt.dm0.hart_index = 7;
+  tgt.dm0.iprio = 3;
+  root->writeTarget(64, tgt.value);
+  root->writeSetienum(64);
+  aplic.setSourceState(64, true);
+  assert(root->readTopi(7) == ((64u << 16) | 3));
+
+  std::cerr << "Test test_26_source_count_bound passed.\n";
+}
+
+void test_27_non_member_idcs()
+{
+  unsigned hartCount = 4, sourceCount = 40;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root",  std::nullopt, 0, addr,              domainSize, Machine,    {3, 1} },
+      { "child", "root",       0, addr + domainSize, domainSize, Supervisor, {3} },
+  };
+  Aplic aplic(hartCount, sourceCount, domain_params);
+  auto root = aplic.root();
+  auto child = root->child(0);
+
+  assert(root->includesHart(3) and root->includesHart(1));
+  assert(not root->includesHart(0) and not root->includesHart(2));
+  assert(root->hartSlot(3) == 0 and root->hartSlot(1) == 1);
+  assert(root->hartSlot(2) == Domain::no_slot and root->hartSlot(100) == Domain::no_slot);
+
+  // IDCs of harts outside the domain are read-only zero.
+  root->writeIdelivery(0, 1);
+  root->writeIthreshold(2, 5);
+  assert(root->readIdelivery(0) == 0);
+  assert(root->readIthreshold(2) == 0);
+  uint32_t value = 1;
+  aplic.write(addr + domainSize + 0x4000 + 32*1, 4, 1);
+  aplic.read(addr + domainSize + 0x4000 + 32*1, 4, value);
+  assert(value == 0);
+
+  // Member IDCs are independent of the order harts were listed in.
+  root->writeIthreshold(1, 2);
+  root->writeIthreshold(3, 4);
+  assert(root->readIthreshold(1) == 2 and root->readIthreshold(3) == 4);
+  child->writeIthreshold(3, 6);
+  assert(child->readIthreshold(3) == 6);
+
+  // Sources beyond numSources read zero.
+  assert(root->readSourcecfg(41) == 0 and root->readTarget(1023) == 0);
+
+  DomainParams dup_params[] = {
+      { "root", std::nullopt, 0, addr, domainSize, Machine, {0, 1, 0} },
+  };
+  bool threw = false;
+  try {
+    Aplic dup(hartCount, sourceCount, dup_params);
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  assert(threw);
+
+  std::cerr << "Test test_27_non_member_idcs passed.\n";
+}
+
+void test_28_msi_ready_sources()
+{
+  unsigned hartCount = 1, interruptCount = 200;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root",  std::nullopt, 0, addr,              domainSize, Machine,    {0} },
+      { "child", "root",       0, addr + domainSize, domainSize, Supervisor, {0} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  auto root = aplic.root();
+  auto child = root->child(0);
+
+  std::vector<uint32_t> eiids;
+  aplic.setMsiCallback([&eiids](uint64_t, uint32_t data) {
+    eiids.push_back(data);
+    return true;
+  });
+  aplic.autoForwardViaMsi = false;
+
+  // Sources spread over several words, delegated to an MSI-mode child.
+  unsigned sources[] = {3, 31, 32, 97, 150, 200};
+  Sourcecfg delegate{};
+  delegate.d1.d = true;
+  Sourcecfg edge1{};
+  edge1.d0.sm = Edge1;
+  for (unsigned i : sources) {
+    root->writeSourcecfg(i, delegate.value);
+    child->writeSourcecfg(i, edge1.value);
+    Target tgt{};
+    tgt.dm1.eiid = i % 64;
+    child->writeTarget(i, tgt.value);
+  }
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  dcfg.fields.dm = MSI;
+  child->writeDomaincfg(dcfg.value);
+  for (unsigned i : sources)
+    child->writeSetipnum(i);
+
+  // Only enabled sources are forwarded, and only by their owning domain.
+  assert(not aplic.forwardViaMsi(97));
+  child->writeSetienum(97);
+  assert(aplic.forwardViaMsi(97));
+  assert(eiids.size() == 1 and eiids[0] == 97 % 64);
+  assert(not aplic.forwardViaMsi(97));
+  assert(not aplic.forwardViaMsi(201));
+
+  // Auto-forwarding delivers every ready source in source order.
+  eiids.clear();
+  for (unsigned i : sources)
+    child->writeSetienum(i);
+  child->writeSetipnum(97);
+  aplic.autoForwardViaMsi = true;
+  child->writeSetipnum(3);
+  std::vector<uint32_t> expected;
+  for (unsigned i : sources)
+    expected.push_back(i % 64);
+  assert(eiids == expected);
+  for (unsigned w = 0; w < 7; w++)
+    assert(child->readSetip(w) == 0);
+
+  std::cerr << "Test test_28_msi_ready_sources passed.\n";
+}
+
+void test_29_source_owner()
+{
+  unsigned hartCount = 2, interruptCount = 16;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root",   std::nullopt, 0, addr,                domainSize, Machine,    {0} },
+      { "child",  "root",       0, addr + domainSize,   domainSize, Supervisor, {0} },
+      { "child2", "root",       1, addr + 2*domainSize, domainSize, Machine,    {1} },
+      { "child3", "child2",     0, addr + 3*domainSize, domainSize, Supervisor, {1} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  auto root = aplic.root();
+  auto child = root->child(0);
+  auto child2 = root->child(1);
+  auto child3 = child2->child(0);
+
+  assert(aplic.findDomainBySource(0) == nullptr);
+  assert(aplic.findDomainBySource(17) == nullptr);
+  assert(aplic.findDomainBySource(5) == root);
+
+  Sourcecfg to_child0{};
+  to_child0.d1.d = true;
+  Sourcecfg to_child1 = to_child0;
+  to_child1.d1.child_index = 1;
+  root->writeSourcecfg(5, to_child1.value);
+  child2->writeSourcecfg(5, to_child0.value);
+  assert(aplic.findDomainBySource(5) == child3);
+
+  // Edges go straight to the owning domain.
+  Sourcecfg level1{};
+  level1.d0.sm = Level1;
+  child3->writeSourcecfg(5, level1.value);
+  aplic.setSourceState(5, true);
+  assert(child3->readSetip(0) == (1u << 5));
+
+  // Re-delegating moves ownership, undelegating the old subtree.
+  root->writeSourcecfg(5, to_child0.value);
+  assert(aplic.findDomainBySource(5) == child);
+  assert(child3->readSourcecfg(5) == 0);
+  root->writeSourcecfg(5, 0);
+  assert(aplic.findDomainBySource(5) == root);
+
+  // Reset returns every source to the root.
+  root->writeSourcecfg(6, to_child1.value);
+  child2->writeSourcecfg(6, to_child0.value);
+  assert(aplic.findDomainBySource(6) == child3);
+  aplic.reset();
+  assert(aplic.findDomainBySource(6) == root);
+
+  std::cerr << "Test test_29_source_owner passed.\n";
+}
+
+void test_30_thread_safe()
+{
+  unsigned hartCount = 2, interruptCount = 16;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root", std::nullopt, 0, addr,                domainSize, Machine,    {0, 1} },
+      { "s0",   "root",       0, addr + domainSize,   domainSize, Supervisor, {0} },
+      { "s1",   "root",       1, addr + 2*domainSize, domainSize, Supervisor, {1} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params, true);
+  assert(aplic.threadSafe());
+
+  std::atomic<unsigned> raised[2] = {0, 0}, lowered[2] = {0, 0};
+  aplic.setDirectCallback([&](unsigned hart, Privilege, bool state) {
+    (state ? raised : lowered)[hart]++;
+    return true;
+  });
+
+  // Sources 1-8 go to s0 and 9-16 to s1, edge-triggered, direct delivery.
+  auto root = aplic.root();
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  Sourcecfg edge1{};
+  edge1.d0.sm = Edge1;
+  for (unsigned k = 0; k < 2; k++) {
+    auto domain = root->child(k);
+    domain->writeDomaincfg(dcfg.value);
+    domain->writeIdelivery(k, 1);
+    for (unsigned i = 1 + 8*k; i <= 8 + 8*k; i++) {
+      Sourcecfg delegate{};
+      delegate.d1.d = true;
+      delegate.d1.child_index = k;
+      root->writeSourcecfg(i, delegate.value);
+      domain->writeSourcecfg(i, edge1.value);
+      Target tgt{};
+      tgt.dm0.hart_index = k;
+      tgt.dm0.iprio = 1;
+      domain->writeTarget(i, tgt.value);
+      domain->writeSetienum(i);
+    }
+  }
+
+  const unsigned iterations = 2000;
+  std::atomic<bool> done = false;
+  std::atomic<unsigned> failures = 0;
+
+  // Each hart raises and claims interrupts in its own domain.
+  auto hart = [&](unsigned k) {
+    uint64_t claimi = addr + (k + 1)*domainSize + 0x4000 + 32*k + 0x1c;
+    for (unsigned n = 0; n < iterations; n++) {
+      unsigned i = 1 + 8*k + n % 8;
+      aplic.setSourceState(i, true);
+      uint32_t claim = 0;
+      aplic.read(claimi, 4, claim);
+      if (claim >> 16 != i)
+        failures++;
+      aplic.setSourceState(i, false);
+    }
+  };
+
+  // Meanwhile, lock-free readers only ever see legal values.
+  auto reader = [&]() {
+    while (not done) {
+      for (unsigned k = 0; k < 2; k++) {
+        uint64_t base = addr + (k + 1)*domainSize;
+        uint32_t topi = 0, cfg = 0, srccfg = 0;
+        aplic.read(base + 0x4000 + 32*k + 0x18, 4, topi);
+        aplic.read(base, 4, cfg);
+        aplic.read(base + 4*(1 + 8*k), 4, srccfg);
+        unsigned iid = topi >> 16;
+        if ((topi != 0 and (iid < 1 + 8*k or iid > 8 + 8*k)) or cfg != 0x80000100 or srccfg != Edge1)
+          failures++;
+      }
+    }
+  };
+
+  std::thread r(reader);
+  std::thread h0(hart, 0), h1(hart, 1);
+  h0.join();
+  h1.join();
+  done = true;
+  r.join();
+
+  assert(failures == 0);
+  for (unsigned k = 0; k < 2; k++) {
+    assert(raised[k] == iterations and lowered[k] == iterations);
+    assert(root->child(k)->readTopi(k) == 0);
+  }
+
+  std::cerr << "Test test_30_thread_safe passed.\n";
+}
+
+void test_31_posted_source_states()
+{
+  unsigned hartCount = 1, interruptCount = 64;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root", std::nullopt, 0, addr, domainSize, Machine, {0} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  auto root = aplic.root();
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  root->writeDomaincfg(dcfg.value);
+  Sourcecfg level1{};
+  level1.d0.sm = Level1;
+  for (unsigned i = 1; i <= interruptCount; i++)
+    root->writeSourcecfg(i, level1.value);
+
+  assert(not aplic.postSourceState(0, true));
+  assert(not aplic.postSourceState(65, true));
+  assert(aplic.drainSourceStates() == 0);
+
+  // Posting has no effect until the queue is drained, in posting order.
+  assert(aplic.postSourceState(5, true));
+  assert(aplic.postSourceState(5, false));
+  assert(aplic.postSourceState(6, true));
+  assert(not aplic.getSourceState(6) and root->readSetip(0) == 0);
+  assert(aplic.drainSourceStates(true) == 3);
+  assert(not aplic.getSourceState(5) and aplic.getSourceState(6));
+  assert(root->readSetip(0) == (1u << 6));
+
+  // A full queue refuses further posts rather than waiting.
+  for (size_t n = 0; n < Aplic::source_state_queue_capacity; n++)
+    assert(aplic.postSourceState(7, n % 2 == 0));
+  assert(not aplic.postSourceState(7, true));
+  assert(aplic.drainSourceStates() == Aplic::source_state_queue_capacity);
+  assert(not aplic.getSourceState(7));
+
+  // A reset discards the changes still queued.
+  assert(aplic.postSourceState(8, true));
+  aplic.reset();
+  assert(aplic.drainSourceStates() == 0);
+  assert(not aplic.getSourceState(8));
+  root->writeDomaincfg(dcfg.value);
+  for (unsigned i = 1; i <= interruptCount; i++)
+    root->writeSourcecfg(i, level1.value);
+
+  // Device threads post concurrently; each ends with its sources high.
+  std::vector<std::thread> devices;
+  for (unsigned k = 0; k < 4; k++) {
+    devices.emplace_back([&aplic, k]() {
+      for (unsigned n = 0; n < 1000; n++) {
+        unsigned i = 33 + 8*k + n % 8;
+        while (not aplic.postSourceState(i, n >= 992))
+          std::this_thread::yield();
+      }
+    });
+  }
+  size_t applied = 0;
+  while (applied < 4000)
+    applied += aplic.drainSourceStates();
+  for (auto& device : devices)
+    device.join();
+  assert(applied == 4000);
+  assert(root->readSetip(1) == 0xffff'fffe and root->readSetip(2) == 1);
+
+  std::cerr << "Test test_31_posted_source_states passed.\n";
+}
+
+void test_32_source_state_words()
+{
+  unsigned hartCount = 1, interruptCount = 40;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root", std::nullopt, 0, addr, domainSize, Machine, {0} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  auto root = aplic.root();
+  Sourcecfg level0{};
+  level0.d0.sm = Level0;
+  root->writeSourcecfg(35, level0.value);
+
+  // Bits for source 0 and unimplemented sources are ignored.
+  aplic.setSourceStateWord(0, ~0u);
+  aplic.setSourceStateWord(1, ~0u);
+  assert(aplic.getSourceStateWord(0) == 0xffff'fffe);
+  assert(aplic.getSourceStateWord(1) == 0x1ff);
+  assert(aplic.getSourceState(40) and not aplic.getSourceState(0));
+  assert(aplic.getSourceStateWord(2) == 0);
+
+  // Word-wide rectification sees the new inputs.
+  assert(root->readInClrip(1) == 0);
+  aplic.setSourceStateWord(1, 0);
+  assert(root->readInClrip(1) == (1u << 3));
+  assert(root->readSetip(1) == (1u << 3));
+
+  bool threw = false;
+  try {
+    aplic.getSourceState(41);
+  } catch (const std::out_of_range&) {
+    threw = true;
+  }
+  assert(threw);
+
+  std::cerr << "Test test_32_source_state_words passed.\n";
+}
+
+struct TestImsic {
+  std::vector<std::pair<uint64_t, uint32_t>> writes;
+  bool deliverMsi(uint64_t addr, uint32_t data) {
+    writes.push_back({addr, data});
+    return true;
+  }
+};
+
+struct TestHarts final : DeliverySink {
+  std::vector<InterruptRecord> records;
+  bool deliverDirect(unsigned hart, Privilege privilege, bool xeip) override {
+    records.push_back({hart, privilege, xeip});
+    return true;
+  }
+  bool deliverMsi(uint64_t, uint32_t) override { return false; }
+};
+
+void test_33_delivery_sink()
+{
+  unsigned hartCount = 1, interruptCount = 8;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root",  std::nullopt, 0, addr,              domainSize, Machine,    {0} },
+      { "child", "root",       0, addr + domainSize, domainSize, Supervisor, {0} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  auto root = aplic.root();
+  auto child = root->child(0);
+
+  // MSIs go to a class that only knows about MSIs.
+  TestImsic imsic;
+  DeliverySinkAdapter<TestImsic> imsic_sink(imsic);
+  aplic.setDeliverySink(&imsic_sink);
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  dcfg.fields.dm = MSI;
+  root->writeDomaincfg(dcfg.value);
+  Sourcecfg edge1{};
+  edge1.d0.sm = Edge1;
+  root->writeSourcecfg(1, edge1.value);
+  Target tgt{};
+  tgt.dm1.eiid = 9;
+  root->writeTarget(1, tgt.value);
+  root->writeSetienum(1);
+  aplic.setSourceState(1, true);
+  assert(imsic.writes.size() == 1 and imsic.writes[0].second == 9);
+
+  // Direct deliveries, including the child's, go to a DeliverySink subclass.
+  TestHarts harts;
+  aplic.setDeliverySink(&harts);
+  Sourcecfg delegate{};
+  delegate.d1.d = true;
+  root->writeSourcecfg(2, delegate.value);
+  child->writeSourcecfg(2, edge1.value);
+  dcfg.fields.dm = Direct;
+  child->writeDomaincfg(dcfg.value);
+  child->writeSetienum(2);
+  child->writeIdelivery(0, 1);
+  aplic.setSourceState(2, true);
+  assert(harts.records.size() == 1);
+  assert(harts.records[0].privilege == Supervisor and harts.records[0].state);
+
+  // Setting a callback switches back to callbacks.
+  unsigned calls = 0;
+  aplic.setDirectCallback([&calls](unsigned, Privilege, bool) { calls++; return true; });
+  child->writeClripnum(2);
+  assert(calls == 1 and harts.records.size() == 1);
+
+  aplic.setDeliverySink(nullptr);
+  child->writeSetipnum(2);
+  assert(calls == 1 and harts.records.size() == 1);
+
+  std::cerr << "Test test_33_delivery_sink passed.\n";
+}
+
+
+void test_34_msi_batch_callback()
+{
+  unsigned hartCount = 1, interruptCount = 8;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root",  std::nullopt, 0, addr,              domainSize, Machine,    {0} },
+      { "child", "root",       0, addr + domainSize, domainSize, Supervisor, {0} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  auto root = aplic.root();
+
+  std::vector<uint32_t> singles;
+  std::vector<std::vector<uint32_t>> batches;
+  aplic.setMsiCallback([&singles](uint64_t, uint32_t data) { singles.push_back(data); return true; });
+  aplic.setMsiBatchCallback([&batches](std::span<const std::pair<uint64_t, uint32_t>> msis) {
+    batches.emplace_back();
+    for (auto& msi : msis)
+      batches.back().push_back(msi.second);
+    return true;
+  });
+
+  Domaincfg dcfg{};
+  dcfg.fields.dm = MSI;
+  root->writeDomaincfg(dcfg.value);
+  Sourcecfg edge1{};
+  edge1.d0.sm = Edge1;
+  for (unsigned i : {5, 1, 3}) {
+    root->writeSourcecfg(i, edge1.value);
+    Target tgt{};
+    tgt.dm1.eiid = 10 + i;
+    root->writeTarget(i, tgt.value);
+    root->writeSetienum(i);
+    root->writeSetipnum(i);
+  }
+  assert(singles.empty() and batches.empty());
+
+  // Enabling the domain forwards all three in one batch, in source order.
+  dcfg.fields.ie = 1;
+  root->writeDomaincfg(dcfg.value);
+  assert(singles.empty());
+  assert(batches.size() == 1 and batches[0] == (std::vector<uint32_t>{11, 13, 15}));
+
+  // A single MSI goes to the MSI callback.
+  root->writeSetipnum(3);
+  assert(singles.size() == 1 and singles[0] == 13 and batches.size() == 1);
+
+  // Without a batch callback, each MSI goes to the MSI callback.
+  aplic.setMsiBatchCallback(nullptr);
+  dcfg.fields.ie = 0;
+  root->writeDomaincfg(dcfg.value);
+  root->writeSetipnum(1);
+  root->writeSetipnum(5);
+  dcfg.fields.ie = 1;
+  root->writeDomaincfg(dcfg.value);
+  assert(singles == (std::vector<uint32_t>{13, 11, 15}) and batches.size() == 1);
+
+  // MSIs of several domains come domain by domain, in pre-order of the
+  // hierarchy; within a domain genmsi comes first, then source ID order.
+  DomainParams two_children[] = {
+      { "root", std::nullopt, 0, addr,                domainSize, Machine,    {1} },
+      { "a",    "root",       0, addr + domainSize,   domainSize, Machine,    {0} },
+      { "b",    "root",       1, addr + 2*domainSize, domainSize, Supervisor, {1} },
+  };
+  Aplic aplic2(2, interruptCount, two_children);
+  batches.clear();
+  aplic2.setMsiCallback([](uint64_t, uint32_t) { return true; });
+  aplic2.setMsiBatchCallback([&batches](std::span<const std::pair<uint64_t, uint32_t>> msis) {
+    batches.emplace_back();
+    for (auto& msi : msis)
+      batches.back().push_back(msi.second);
+    return true;
+  });
+  auto root2 = aplic2.root();
+  Domaincfg msi_cfg{};
+  msi_cfg.fields.dm = MSI;
+  msi_cfg.fields.ie = 1;
+  for (unsigned d = 0; d < 2; d++)
+    root2->child(d)->writeDomaincfg(msi_cfg.value);
+  for (unsigned i = 1; i <= 5; i++) {
+    auto child = root2->child(i < 3 ? 1 : 0);
+    Sourcecfg to_child{};
+    to_child.d1.d = 1;
+    to_child.d1.child_index = i < 3 ? 1 : 0;
+    root2->writeSourcecfg(i, to_child.value);
+    child->writeSourcecfg(i, edge1.value);
+    Target tgt{};
+    tgt.dm1.eiid = 10 + i;
+    child->writeTarget(i, tgt.value);
+    child->writeSetienum(i);
+  }
+  aplic2.beginBatch();
+  for (unsigned i : {5, 2, 3, 1})
+    aplic2.setSourceState(i, true);
+  Genmsi genmsi{};
+  genmsi.fields.eiid = 30;
+  root2->child(1)->writeGenmsi(genmsi.value);
+  aplic2.commit();
+  assert(batches.size() == 1 and batches[0] == (std::vector<uint32_t>{13, 15, 30, 11, 12}));
+
+  std::cerr << "Test test_34_msi_batch_callback passed.\n";
+}
+
+
+void test_35_msi_addr_cache()
+{
+  unsigned hartCount = 8, interruptCount = 8;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root",  std::nullopt, 0, addr,              domainSize, Machine,    {0, 1, 2, 3, 4, 5, 6, 7} },
+      { "child", "root",       0, addr + domainSize, domainSize, Supervisor, {0, 1, 2, 3, 4, 5, 6, 7} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  auto root = aplic.root();
+  auto child = root->child(0);
+
+  std::vector<uint64_t> addrs;
+  aplic.setMsiCallback([&addrs](uint64_t a, uint32_t) { addrs.push_back(a); return true; });
+
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  dcfg.fields.dm = MSI;
+  root->writeDomaincfg(dcfg.value);
+  child->writeDomaincfg(dcfg.value);
+  Sourcecfg edge1{};
+  edge1.d0.sm = Edge1;
+  Sourcecfg delegate{};
+  delegate.d1.d = true;
+  root->writeSourcecfg(1, edge1.value);
+  root->writeSourcecfg(2, delegate.value);
+  child->writeSourcecfg(2, edge1.value);
+  Target tgt{};
+  tgt.dm1.hart_index = 5;
+  tgt.dm1.eiid = 1;
+  root->writeTarget(1, tgt.value);
+  tgt.dm1.guest_index = 3;
+  child->writeTarget(2, tgt.value);
+  root->writeSetienum(1);
+  child->writeSetienum(2);
+
+  // Hart 5 is group 1, hart 1 within the group: lhxw = 2, hhxw = 1.
+  Mmsiaddrcfgh mcfgh{};
+  mcfgh.fields.ppn = 0x1;
+  mcfgh.fields.lhxw = 2;
+  mcfgh.fields.hhxw = 1;
+  mcfgh.fields.lhxs = 1;
+  mcfgh.fields.hhxs = 4;
+  root->writeMmsiaddrcfg(0x80000);
+  root->writeMmsiaddrcfgh(mcfgh.value);
+  Smsiaddrcfgh scfgh{};
+  scfgh.fields.lhxs = 3;
+  root->writeSmsiaddrcfg(0x90000);
+  root->writeSmsiaddrcfgh(scfgh.value);
+
+  root->writeSetipnum(1);
+  child->writeSetipnum(2);
+  uint64_t group = 1ull << (4 + 24);
+  assert(addrs.size() == 2);
+  assert(addrs[0] == ((0x100080000ull << 12) | group | (1ull << 13)));
+  assert(addrs[1] == ((0x90000ull << 12) | group | (1ull << 15) | (3ull << 12)));
+
+  // Changing the address configuration affects targets already written.
+  root->writeMmsiaddrcfg(0xa0000);
+  root->writeSetipnum(1);
+  assert(addrs.size() == 3 and addrs[2] == ((0x1000a0000ull << 12) | group | (1ull << 13)));
+
+  // Once locked, the configuration no longer changes.
+  mcfgh.fields.l = 1;
+  root->writeMmsiaddrcfgh(mcfgh.value);
+  root->writeMmsiaddrcfg(0xb0000);
+  root->writeSetipnum(1);
+  assert(addrs.size() == 4 and addrs[3] == addrs[2]);
+
+  aplic.reset();
+  root->writeDomaincfg(dcfg.value);
+  root->writeSourcecfg(1, edge1.value);
+  root->writeSetienum(1);
+  root->writeSetipnum(1);
+  assert(addrs.size() == 5 and addrs[4] == 0);
+
+  std::cerr << "Test test_35_msi_addr_cache passed.\n";
+}
+
+
+void test_36_save_restore()
+{
+  unsigned hartCount = 2, interruptCount = 40;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root",  std::nullopt, 0, addr,              domainSize, Machine,    {0, 1} },
+      { "child", "root",       0, addr + domainSize, domainSize, Supervisor, {0, 1} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  auto root = aplic.root();
+  auto child = root->child(0);
+  unsigned calls = 0;
+  aplic.setDirectCallback([&calls](unsigned, Privilege, bool) { calls++; return true; });
+
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  root->writeDomaincfg(dcfg.value);
+  child->writeDomaincfg(dcfg.value);
+  Sourcecfg level1{};
+  level1.d0.sm = Level1;
+  Sourcecfg delegate{};
+  delegate.d1.d = true;
+  root->writeSourcecfg(3, level1.value);
+  root->writeSourcecfg(35, delegate.value);
+  child->writeSourcecfg(35, level1.value);
+  Target tgt{};
+  tgt.dm0.hart_index = 1;
+  tgt.dm0.iprio = 5;
+  child->writeTarget(35, tgt.value);
+  root->writeSetienum(3);
+  child->writeSetienum(35);
+  root->writeIdelivery(0, 1);
+  child->writeIdelivery(1, 1);
+  aplic.setSourceState(3, true);
+  aplic.setSourceState(35, true);
+  assert(calls == 2);
+  auto state = aplic.saveState();
+
+  // Change everything, then restore; no callbacks are made.
+  aplic.setSourceState(3, false);
+  aplic.setSourceState(35, false);
+  root->writeSourcecfg(35, 0);
+  assert(calls == 4);
+  aplic.restoreState(state);
+  assert(calls == 4);
+  assert(aplic.getSourceState(3) and aplic.getSourceState(35));
+  assert(root->readSourcecfg(35) == delegate.value and child->readSourcecfg(35) == level1.value);
+  assert(child->readTarget(35) == tgt.value);
+  assert(root->readTopi(0) == ((3 << 16) | 1));
+  assert(child->readTopi(1) == ((35 << 16) | 5));
+  assert(aplic.findDomainBySource(35) == child);
+
+  // Delivery continues from the restored state.
+  aplic.setSourceState(35, false);
+  assert(calls == 5 and child->readTopi(1) == 0);
+
+  // A second Aplic with the same hierarchy takes on the same state.
+  Aplic copy(hartCount, interruptCount, domain_params);
+  copy.restoreState(state);
+  assert(copy.saveState() == state);
+  assert(copy.root()->child(0)->readTopi(1) == ((35 << 16) | 5));
+
+  // A different hierarchy is rejected and left unchanged.
+  Aplic other(hartCount, interruptCount, std::span(domain_params, 1));
+  bool threw = false;
+  try {
+    other.restoreState(state);
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  assert(threw and other.root()->readSourcecfg(3) == 0);
+
+  threw = false;
+  aplic.beginBatch();
+  try {
+    aplic.saveState();
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  aplic.commit();
+  assert(threw);
+
+  std::cerr << "Test test_36_save_restore passed.\n";
+}
+
+
+void test_37_fork()
+{
+  unsigned hartCount = 2, interruptCount = 40;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root",  std::nullopt, 0, addr,              domainSize, Machine,    {0, 1} },
+      { "child", "root",       0, addr + domainSize, domainSize, Supervisor, {0, 1} },
+  };
+  for (bool thread_safe : {false, true}) {
+    Aplic aplic(hartCount, interruptCount, domain_params, thread_safe);
+    auto root = aplic.root();
+    auto child = root->child(0);
+    unsigned calls = 0;
+    aplic.setDirectCallback([&calls](unsigned, Privilege, bool) { calls++; return true; });
+
+    Domaincfg dcfg{};
+    dcfg.fields.ie = 1;
+    root->writeDomaincfg(dcfg.value);
+    child->writeDomaincfg(dcfg.value);
+    Sourcecfg edge1{};
+    edge1.d0.sm = Edge1;
+    Sourcecfg delegate{};
+    delegate.d1.d = true;
+    root->writeSourcecfg(3, edge1.value);
+    root->writeSourcecfg(35, delegate.value);
+    child->writeSourcecfg(35, edge1.value);
+    root->writeSetienum(3);
+    child->writeSetienum(35);
+    root->writeIdelivery(0, 1);
+    child->writeIdelivery(0, 1);
+    aplic.setSourceState(3, true);
+    assert(calls == 1);
+
+    auto fork = aplic.fork();
+    assert(fork->saveState() == aplic.saveState());
+    assert(fork->threadSafe() == thread_safe);
+    auto fork_root = fork->root();
+    auto fork_child = fork_root->child(0);
+    assert(fork_root != root and fork_child->parent() == fork_root);
+    assert(fork->findDomainBySource(35) == fork_child);
+    assert(fork->findDomainByAddr(addr + domainSize) == fork_child);
+
+    // The fork delivers to the same callback until given its own.
+    fork->setSourceState(35, true);
+    assert(calls == 2);
+    unsigned fork_calls = 0;
+    fork->setDirectCallback([&fork_calls](unsigned, Privilege, bool) { fork_calls++; return true; });
+
+    // Writes to either copy are not seen by the other.
+    Target tgt{};
+    tgt.dm0.iprio = 7;
+    child->writeTarget(35, tgt.value);
+    fork_root->writeSourcecfg(3, 0);
+    assert(root->readSourcecfg(3) == edge1.value and fork_root->readSourcecfg(3) == 0);
+    assert(child->readTarget(35) == 7 and fork_child->readTarget(35) == 1);
+    assert(root->readTopi(0) == ((3 << 16) | 1) and fork_root->readTopi(0) == 0);
+    assert(child->readTopi(0) == 0 and fork_child->readTopi(0) == ((35 << 16) | 1));
+    assert(calls == 2 and fork_calls == 1);
+
+    aplic.reset();
+    assert(fork_child->readSourcecfg(35) == edge1.value);
+  }
+
+  std::cerr << "Test test_37_fork passed.\n";
+}
+
+
+void test_38_trace()
+{
+  unsigned hartCount = 1, interruptCount = 8;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  DomainParams domain_params[] = {
+      { "root",  std::nullopt, 0, addr,              domainSize, Machine,    {0} },
+      { "child", "root",       0, addr + domainSize, domainSize, Supervisor, {0} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  aplic.setDirectCallback([](unsigned, Privilege, bool) { return true; });
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  aplic.root()->writeDomaincfg(dcfg.value);
+  Sourcecfg edge1{};
+  edge1.d0.sm = Edge1;
+  aplic.root()->writeSourcecfg(1, edge1.value);
+
+  std::string path = (std::filesystem::temp_directory_path() / "aplic-test.trace").string();
+  aplic.startTrace(path);
+  aplic.write(addr + 0x1edc, 4, 1);     // setienum
+  aplic.write(addr + 0x4000, 4, 1);     // idelivery
+  aplic.setSourceState(1, true);
+  uint32_t claim = 0;
+  aplic.read(addr + 0x401c, 4, claim);  // claimi
+  aplic.beginBatch();
+  aplic.setSourceStates(0, 0x2, 0x0);
+  aplic.commit();
+  aplic.stopTrace();
+
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  std::filesystem::remove(path);
+  size_t header_size = 0;
+  TraceHeader header = TraceHeader::decode(bytes, header_size);
+  assert(header.num_harts == hartCount and header.num_sources == interruptCount);
+  assert(header.domains.size() == 2 and header.domains[1].parent == "root");
+  assert(header.domains[1].base == addr + domainSize and header.domains[1].privilege == Supervisor);
+  Aplic copy(header.num_harts, header.num_sources, header.domains);
+  copy.restoreState(header.state);
+  assert(copy.root()->readSourcecfg(1) == edge1.value);
+
+  assert((bytes.size() - header_size) % sizeof(TraceRecord) == 0);
+  std::vector<TraceRecord> records((bytes.size() - header_size) / sizeof(TraceRecord));
+  std::memcpy(records.data(), bytes.data() + header_size, bytes.size() - header_size);
+  std::vector<TraceOp> ops;
+  for (auto& record : records)
+    ops.push_back(record.op);
+  std::vector<TraceOp> expected = {
+    TraceOp::Write, TraceOp::Write, TraceOp::DirectDelivery, TraceOp::SourceState,
+    TraceOp::DirectDelivery, TraceOp::Read, TraceOp::BeginBatch, TraceOp::SourceStateWord, TraceOp::Commit,
+  };
+  assert(ops == expected);
+  assert(records[2].addr == 0 and records[2].data == 1 and records[2].flags == Machine);
+  assert(records[5].addr == addr + 0x401c and records[5].data == claim and claim == ((1 << 16) | 1));
+  assert(records[7].addr == (0 | uint64_t(0x2) << 32) and records[7].data == 0);
+  for (size_t k = 1; k < records.size(); k++)
+    assert(records[k].time >= records[k - 1].time);
+
+  std::cerr << "Test test_38_trace passed.\n";
+}
+
+
+void test_39_stats()
+{
+  unsigned hartCount = 1, interruptCount = 8;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  uint64_t child_addr = addr + domainSize;
+  DomainParams domain_params[] = {
+      { "root",  std::nullopt, 0, addr,       domainSize, Machine,    {0} },
+      { "child", "root",       0, child_addr, domainSize, Supervisor, {0} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  unsigned msis = 0;
+  aplic.setDirectCallback([](unsigned, Privilege, bool) { return true; });
+  aplic.setMsiCallback([&msis](uint64_t, uint32_t) { msis++; return true; });
+
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  aplic.write(addr, 4, dcfg.value);
+  Sourcecfg edge1{};
+  edge1.d0.sm = Edge1;
+  Sourcecfg delegate{};
+  delegate.d1.d = 1;
+  aplic.write(addr + 0x4, 4, edge1.value);
+  aplic.write(addr + 0x8, 4, delegate.value);
+  aplic.write(addr + 0x1edc, 4, 1);     // setienum
+  aplic.write(addr + 0x4000, 4, 1);     // idelivery
+
+  dcfg.fields.dm = MSI;
+  aplic.write(child_addr, 4, dcfg.value);
+  aplic.write(child_addr + 0x8, 4, edge1.value);
+  aplic.write(child_addr + 0x3008, 4, 2);   // target: eiid 2
+  aplic.write(child_addr + 0x1edc, 4, 2);   // setienum
+
+  aplic.setSourceState(1, true);
+  aplic.setSourceState(2, true);
+  uint32_t data = 0;
+  aplic.read(addr + 0x401c, 4, data);   // claimi
+  assert(data == ((1 << 16) | 1));
+  aplic.read(addr + 0x401c, 4, data);   // spurious
+  assert(data == 0);
+  aplic.read(addr + 0x1000, 4, data);   // reserved
+  aplic.write(child_addr + 0x3000, 4, 3);   // genmsi: eiid 3
+  assert(aplic.forwardViaMsi(0));
+  assert(msis == 2);
+
+  auto stats = aplic.stats();
+  assert(stats.size() == 2 and stats[0].first == "root" and stats[1].first == "child");
+  const auto& root = stats[0].second;
+  const auto& child = stats[1].second;
+  if (stats_enabled) {
+    assert(root.writes[DomaincfgReg] == 1 and root.writes[SourcecfgReg] == 2);
+    assert(root.writes[EnableReg] == 1 and root.writes[IdcReg] == 1);
+    assert(root.reads[IdcReg] == 2 and root.reads[ReservedReg] == 1);
+    assert(root.edges == 1 and root.set_ips == 1 and root.clear_ips == 1);
+    assert(root.topi_updates >= 2 and root.direct_deliveries == 2);
+    assert(root.claims == 1 and root.spurious_claims == 1);
+    assert(root.msis_forwarded == 0 and root.genmsi_sends == 0);
+    assert(child.writes[DomaincfgReg] == 1 and child.writes[TargetReg] == 1 and child.writes[GenmsiReg] == 1);
+    assert(child.edges == 1 and child.set_ips == 1 and child.clear_ips == 1);
+    assert(child.msis_forwarded == 1 and child.genmsi_sends == 1);
+    assert(child.direct_deliveries == 0 and child.claims == 0);
+  } else {
+    assert(root == DomainStats{} and child == DomainStats{});
+  }
+
+  auto copy = aplic.fork();
+  for (auto& [name, domain_stats] : copy->stats())
+    assert(domain_stats == DomainStats{});
+
+  aplic.resetStats();
+  for (auto& [name, domain_stats] : aplic.stats())
+    assert(domain_stats == DomainStats{});
+
+  std::cerr << "Test test_39_stats passed.\n";
+}
+
+
+void test_40_trace_without_sink()
+{
+  unsigned hartCount = 1, interruptCount = 8;
+  uint64_t addr = 0x1000000, domainSize = 32 * 1024;
+  uint64_t child_addr = addr + domainSize;
+  DomainParams domain_params[] = {
+      { "root",  std::nullopt, 0, addr,       domainSize, Machine,    {0} },
+      { "child", "root",       0, child_addr, domainSize, Supervisor, {0} },
+  };
+  Aplic aplic(hartCount, interruptCount, domain_params);
+  auto root = aplic.root();
+  auto child = root->child(0);
+  Domaincfg dcfg{};
+  dcfg.fields.ie = 1;
+  root->writeDomaincfg(dcfg.value);
+  dcfg.fields.dm = MSI;
+  child->writeDomaincfg(dcfg.value);
+  Sourcecfg edge1{}, to_child{};
+  edge1.d0.sm = Edge1;
+  to_child.d1.d = 1;
+  root->writeSourcecfg(1, edge1.value);
+  root->writeSourcecfg(2, to_child.value);
+  child->writeSourcecfg(2, edge1.value);
+  Target tgt{};
+  tgt.dm1.eiid = 9;
+  child->writeTarget(2, tgt.value);
+  auto saved = aplic.saveState();
+
+  // Nothing receives the deliveries, but the trace has them all, and a
+  // restore in the middle of it.
+  std::string path = (std::filesystem::temp_directory_path() / "aplic-test-nosink.trace").string();
+  aplic.startTrace(path);
+  bool threw = false;
+  try {
+    aplic.setDirectCallback([](unsigned, Privilege, bool) { return true; });
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  assert(threw);
+  aplic.write(addr + 0x1edc, 4, 1);         // setienum
+  aplic.write(addr + 0x4000, 4, 1);         // idelivery
+  aplic.setSourceState(1, true);
+  aplic.write(child_addr + 0x1edc, 4, 2);   // setienum
+  aplic.setSourceState(2, true);
+  aplic.restoreState(saved);
+  aplic.write(addr + 0x1edc, 4, 1);         // setienum
+  aplic.write(addr + 0x4000, 4, 1);         // idelivery
+  aplic.write(addr + 0x1cdc, 4, 1);         // setipnum
+  aplic.stopTrace();
+  aplic.setDirectCallback([](unsigned, Privilege, bool) { return true; });
+
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  std::filesystem::remove(path);
+  size_t header_size = 0;
+  TraceHeader header = TraceHeader::decode(bytes, header_size);
+  std::vector<TraceRecord> records((bytes.size() - header_size) / sizeof(TraceRecord));
+  std::memcpy(records.data(), bytes.data() + header_size, bytes.size() - header_size);
+
+  // Replaying with callbacks makes the recorded deliveries.
+  Aplic replayed(header.num_harts, header.num_sources, header.domains);
+  replayed.restoreState(header.state);
+  std::vector<TraceRecord> made, recorded;
+  replayed.setDirectCallback([&made](unsigned hart, Privilege privilege, bool xeip) {
+    made.push_back({0, hart, xeip, TraceOp::DirectDelivery, uint8_t(privilege), 0});
+    return true;
+  });
+  replayed.setMsiCallback([&made](uint64_t msi_addr, uint32_t data) {
+    made.push_back({0, msi_addr, data, TraceOp::MsiDelivery, 0, 0});
+    return true;
+  });
+  std::vector<uint32_t> state;
+  for (auto& record : records) {
+    switch (record.op) {
+      case TraceOp::Write:
+        replayed.write(record.addr, 4, record.data);
+        break;
+      case TraceOp::SourceState:
+        replayed.setSourceState(record.addr, record.data);
+        break;
+      case TraceOp::StateWord:
+        state.push_back(record.data);
+        break;
+      case TraceOp::RestoreState:
+        replayed.restoreState({reinterpret_cast<const uint8_t*>(state.data()), state.size()*sizeof(uint32_t)});
+        break;
+      default:
+        assert(record.op == TraceOp::DirectDelivery or record.op == TraceOp::MsiDelivery);
+        recorded.push_back(record);
+    }
+  }
+  assert(state.size()*sizeof(uint32_t) == saved.size());
+  assert(recorded.size() == 3 and made.size() == 3);
+  assert(recorded[0].op == TraceOp::DirectDelivery and recorded[1].op == TraceOp::MsiDelivery);
+  assert(recorded[1].data == 9 and recorded[2].op == TraceOp::DirectDelivery);
+  for (size_t k = 0; k < made.size(); k++) {
+    assert(made[k].op == recorded[k].op and made[k].addr == recorded[k].addr);
+    assert(made[k].data == recorded[k].data and made[k].flags == recorded[k].flags);
+  }
+
+  std::cerr << "Test test_40_trace_without_sink passed.\n";
+}
+
+
+
 int
 main(int, char**)
 {
@@ -1404,5 +3062,28 @@ main(int, char**)
   test_15_genmsi();
   test_16_sourcecfg_pending();
   test_17_pending_extended();
+  test_18_topi_tiebreak();
+  test_19_dirty_harts();
+  test_20_dirty_domains();
+  test_21_masked_words();
+  test_22_in_clrip_rectified();
+  test_23_address_decode();
+  test_24_batched_source_states();
+  test_25_deferred_commit();
+  test_26_source_count_bound();
+  test_27_non_member_idcs();
+  test_28_msi_ready_sources();
+  test_29_source_owner();
+  test_30_thread_safe();
+  test_31_posted_source_states();
+  test_32_source_state_words();
+  test_33_delivery_sink();
+  test_34_msi_batch_callback();
+  test_35_msi_addr_cache();
+  test_36_save_restore();
+  test_37_fork();
+  test_38_trace();
+  test_39_stats();
+  test_40_trace_without_sink();
   return 0;
 }